@@ -0,0 +1,274 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "lesf/lesf.h"
+#include "lesf/ipc/action_server.h"
+#include "lesf/ipc/user_actions.h"
+#include "lesf/ipc/user_actions_symbols.h"
+
+LESF_CONFIG_SYMBOLS()
+
+using namespace lesf::ipc;
+using namespace lesf::ipc::user::bench;
+
+// Measures the full round trip of actions (id generation, serialization, slot
+//   dispatch, handler thread, response path) over an endpoint within this
+//   process, for an increasing number of concurrent callers :
+//   ipc_bench [seconds per run] [server worker threads] [max allocations per call]
+// With 0 worker threads (the default), the server runs each action in its own
+//   thread, as ActionServer does by default.
+// When given a maximum number of allocations per call, exits with an error if
+//   the round trip of the empty action (the overhead of the library) makes more,
+//   to catch allocation regressions.
+
+///// Instrumentation /////
+
+static std::atomic<std::uint64_t> g_allocations(0);
+static std::atomic<std::uint64_t> g_threads(0);
+
+// The replacements go through malloc() and free(), but must not be inlined :
+//   GCC would then see memory from operator new given to free(), or memory
+//   from malloc() given to operator delete (-Wmismatched-new-delete)
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    ++g_allocations;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    operator delete(ptr);
+}
+
+// Interposed on the C library, to count the threads created by std::thread
+extern "C" int pthread_create(pthread_t* thread, pthread_attr_t const* attr,
+                              void* (*start)(void*), void* arg)
+{
+    typedef int (*pthread_create_t)(pthread_t*, pthread_attr_t const*, void* (*)(void*), void*);
+    static pthread_create_t real = reinterpret_cast<pthread_create_t>(dlsym(RTLD_NEXT, "pthread_create"));
+
+    ++g_threads;
+    return real(thread, attr, start, arg);
+}
+
+///// Callers /////
+
+// Waits for the response of the action started by a caller
+struct Call
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done;
+};
+
+struct Caller
+{
+    std::vector<std::uint32_t> latencies_us; // Reserved up front, sampling stops when full
+    std::uint64_t calls;
+};
+
+template <typename T>
+static void callerLoop(Endpoint* ep, typename T::Params const& params, Caller& caller,
+                       std::atomic<bool>& go, std::atomic<bool>& stop)
+{
+    Call call;
+
+    while (!go)
+        std::this_thread::yield();
+
+    while (!stop)
+    {
+        call.done = false;
+        auto start = std::chrono::steady_clock::now();
+
+        T(params).async(ep, [&call](ResponseOrError<T> const&, std::string const&)
+        {
+            std::lock_guard<std::mutex> lock(call.mutex);
+            call.done = true;
+            call.cond.notify_one();
+        });
+
+        {
+            std::unique_lock<std::mutex> lock(call.mutex);
+            call.cond.wait(lock, [&call]() { return call.done; });
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        if (caller.latencies_us.size() < caller.latencies_us.capacity())
+            caller.latencies_us.push_back(elapsed.count());
+        ++caller.calls;
+    }
+}
+
+// Returns the number of allocations per call
+template <typename T>
+static double runBenchmark(char const* name, Endpoint* ep, typename T::Params const& params,
+                           unsigned callers, double seconds)
+{
+    std::vector<Caller> state(callers);
+    for (auto& caller : state)
+    {
+        caller.latencies_us.reserve(1 << 16);
+        caller.calls = 0;
+    }
+
+    std::atomic<bool> go(false), stop(false);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < callers; ++i)
+        threads.push_back(std::thread(&callerLoop<T>, ep, std::cref(params), std::ref(state[i]), std::ref(go), std::ref(stop)));
+
+    // Only count what happens while the callers run
+    std::uint64_t allocations = g_allocations;
+    std::uint64_t created = g_threads;
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+
+    stop = true;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    allocations = g_allocations - allocations;
+    created = g_threads - created;
+
+    for (auto& thread : threads)
+        thread.join();
+
+    std::uint64_t calls = 0;
+    std::vector<std::uint32_t> latencies;
+    for (auto const& caller : state)
+    {
+        calls += caller.calls;
+        latencies.insert(latencies.end(), caller.latencies_us.begin(), caller.latencies_us.end());
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) -> std::uint32_t
+    {
+        if (latencies.empty())
+            return 0;
+        return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(p * latencies.size()))];
+    };
+
+    double allocations_per_call = calls ? double(allocations) / calls : 0.0;
+
+    std::cout << std::left << std::setw(8) << name << std::right
+              << std::setw(8) << callers
+              << std::setw(12) << std::fixed << std::setprecision(0) << calls / elapsed
+              << std::setw(10) << percentile(0.5)
+              << std::setw(10) << percentile(0.9)
+              << std::setw(10) << percentile(0.99)
+              << std::setw(10) << (latencies.empty() ? 0 : latencies.back())
+              << std::setw(14) << std::setprecision(1) << allocations_per_call
+              << std::setw(14) << std::setprecision(2) << (calls ? double(created) / calls : 0.0)
+              << std::endl;
+
+    return allocations_per_call;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? std::atof(argv[1]) : 2.0;
+    unsigned workers = argc > 2 ? std::atoi(argv[2]) : 0;
+    double max_allocations = argc > 3 ? std::atof(argv[3]) : 0.0;
+
+    Endpoint srv_ep(Endpoint::Server, "ipc_bench");
+    ActionServer srv(srv_ep, workers);
+
+    srv.registerAction<Empty>([](Empty::Params const&, std::string const&) -> ResponseOrError<Empty>
+    {
+        return Empty::Response{};
+    });
+
+    srv.registerAction<Small>([](Small::Params const& params, std::string const&) -> ResponseOrError<Small>
+    {
+        return Small::Response{ params.a + params.b };
+    });
+
+    srv.registerAction<Large>([](Large::Params const& params, std::string const&) -> ResponseOrError<Large>
+    {
+        int total = 0;
+        for (int value : params.values)
+            total += value;
+        return Large::Response{ params.text, total };
+    });
+
+    Endpoint ep(Endpoint::Client, "ipc_bench");
+
+    Small::Params small{ 1, 2 };
+    Large::Params large{ std::string(1024, 'x'), std::vector<int>(128, 7) };
+
+    std::cout << std::left << std::setw(8) << "action" << std::right
+              << std::setw(8) << "callers"
+              << std::setw(12) << "calls/s"
+              << std::setw(10) << "p50 us"
+              << std::setw(10) << "p90 us"
+              << std::setw(10) << "p99 us"
+              << std::setw(10) << "max us"
+              << std::setw(14) << "allocs/call"
+              << std::setw(14) << "threads/call"
+              << std::endl;
+
+    double empty_allocations = 0.0;
+
+    for (unsigned callers = 1; callers <= 64; callers *= 2)
+    {
+        empty_allocations = std::max(empty_allocations, runBenchmark<Empty>("empty", &ep, Empty::Params{}, callers, seconds));
+        runBenchmark<Small>("small", &ep, small, callers, seconds);
+        runBenchmark<Large>("large", &ep, large, callers, seconds);
+    }
+
+    if (max_allocations > 0.0 && empty_allocations > max_allocations)
+    {
+        std::cerr << "allocation regression : " << std::fixed << std::setprecision(1) << empty_allocations
+                  << " allocations per empty action, expected at most " << max_allocations << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+
+#include "lesf/lesf.h"
+
+LESF_CONFIG_SYMBOLS()
+
+using namespace lesf;
+using namespace lesf::ipc;
+
+// Replays a capture file (see ipc::Capture) into a server endpoint, as a client :
+//   ipc_replay <endpoint> <capture> [speed] [sent|received]
+// A speed of 0 replays the frames as fast as possible. By default, the frames
+//   sent by the captured endpoint are replayed, so captures should be taken on
+//   the client side (or use `received` for captures taken on the server side).
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " <endpoint> <capture> [speed] [sent|received]" << std::endl;
+        return 1;
+    }
+
+    double speed = argc > 3 ? std::atof(argv[3]) : 1.0;
+    Capture::Direction direction = argc > 4 && std::string(argv[4]) == "received" ? Capture::Received : Capture::Sent;
+
+    try {
+        Endpoint ep(Endpoint::Client, argv[1]);
+        Replayer replayer(argv[2]);
+
+        auto start = std::chrono::steady_clock::now();
+        std::size_t count = replayer.replay(ep, direction, speed);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+        std::cout << count << " frames replayed in " << elapsed.count() << " ms" << std::endl;
+    } catch (core::Exception const& exc) {
+        std::cerr << exc.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -35,6 +35,7 @@ int main(int argc, char** argv)
     log::Logger::init(argc, argv);
 
     LESF_LOG_TRACE("simple log " << 123456);
+    LESF_LOGF_TRACE("deferred log {}", 123456);
 
     try {
         std::function<void(int)> foo =
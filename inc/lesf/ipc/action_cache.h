@@ -0,0 +1,204 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LESF_IPC_ACTION_CACHE_H__
+#define __LESF_IPC_ACTION_CACHE_H__
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <utility>
+
+namespace lesf { namespace ipc {
+
+class Endpoint;
+
+// Memoization of the responses of an action, as declared in the .def file with
+//   the CACHE(ttl_ms, max_entries) option of ACTION (see lesf/ipc/user_actions.h).
+// A null max_entries disables it (the default), a null ttl_ms keeps responses
+//   until they are evicted.
+struct ActionCachePolicy
+{
+    unsigned ttl_ms;
+    unsigned max_entries;
+};
+
+namespace detail {
+    // LRU cache of the responses of an action, keyed by its serialized
+    //   parameters, which also tracks the actions being run so that identical
+    //   requests received meanwhile wait for their result instead of running
+    //   again. Only responses are cached, not errors.
+    template <typename T>
+    class ActionCache
+    {
+    public:
+        enum Lookup
+        {
+            Hit, // The response is available
+            Coalesced, // An identical action is running, the request waits for it
+            Expired, // An identical action is running, but the request can't wait for it
+            Miss // The request must be run
+        };
+
+        // A request waiting for an identical action
+        struct Waiter
+        {
+            Endpoint* ep;
+            std::string id;
+            int priority;
+            int deadline;
+        };
+
+    public:
+        ActionCache(ActionCachePolicy const& policy) :
+            m_policy(policy)
+        {}
+
+        // Look for the response to the given parameters. On a miss, the
+        //   action is considered running until complete() is called, or until
+        //   promote() finds no request waiting for it. Requests whose deadline
+        //   already passed (expired) don't wait for an identical action.
+        Lookup lookup(std::string const& key, Endpoint& ep, std::string const& id, int priority, int deadline,
+                      bool expired, typename T::Response& response)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto it = m_index.find(key);
+            if (it != m_index.end())
+            {
+                if (M_fresh(*it->second))
+                {
+                    // Most recently used first
+                    m_entries.splice(m_entries.begin(), m_entries, it->second);
+                    response = it->second->response;
+                    return Hit;
+                }
+
+                m_entries.erase(it->second);
+                m_index.erase(it);
+            }
+
+            auto running = m_running.find(key);
+            if (running != m_running.end())
+            {
+                if (expired)
+                    return Expired;
+
+                running->second.push_back(Waiter{ &ep, id, priority, deadline });
+                return Coalesced;
+            }
+
+            m_running.emplace(key, std::vector<Waiter>());
+            return Miss;
+        }
+
+        // The action ran, cache its response (null if it failed) and get the
+        //   requests waiting for it
+        std::vector<Waiter> complete(std::string const& key, typename T::Response const* response)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (response)
+            {
+                auto it = m_index.find(key);
+                if (it != m_index.end())
+                {
+                    m_entries.erase(it->second);
+                    m_index.erase(it);
+                }
+
+                m_entries.push_front(Entry{ key, *response, std::chrono::steady_clock::now() });
+                m_index[key] = m_entries.begin();
+
+                while (m_entries.size() > m_policy.max_entries)
+                {
+                    m_index.erase(m_entries.back().key);
+                    m_entries.pop_back();
+                }
+            }
+
+            return M_release(key);
+        }
+
+        // The action did not run, get the first request waiting for it (if
+        //   any) to run it instead, the others keep waiting
+        bool promote(std::string const& key, Waiter& waiter)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto running = m_running.find(key);
+            if (running == m_running.end())
+                return false;
+
+            if (running->second.empty())
+            {
+                m_running.erase(running);
+                return false;
+            }
+
+            waiter = std::move(running->second.front());
+            running->second.erase(running->second.begin());
+            return true;
+        }
+
+    private:
+        struct Entry
+        {
+            std::string key;
+            typename T::Response response;
+            std::chrono::steady_clock::time_point time;
+        };
+
+        bool M_fresh(Entry const& entry) const
+        {
+            return !m_policy.ttl_ms ||
+                   std::chrono::steady_clock::now() - entry.time < std::chrono::milliseconds(m_policy.ttl_ms);
+        }
+
+        std::vector<Waiter> M_release(std::string const& key)
+        {
+            std::vector<Waiter> waiters;
+
+            auto running = m_running.find(key);
+            if (running != m_running.end())
+            {
+                waiters = std::move(running->second);
+                m_running.erase(running);
+            }
+
+            return waiters;
+        }
+
+    private:
+        ActionCachePolicy m_policy;
+
+        std::mutex m_mutex; // Protect everything below
+        std::list<Entry> m_entries; // Most recently used first
+        std::unordered_map<std::string, typename std::list<Entry>::iterator> m_index;
+        std::map<std::string, std::vector<Waiter>> m_running;
+    };
+}
+
+} }
+
+#endif // __LESF_IPC_ACTION_CACHE_H__
@@ -20,14 +20,29 @@
 #define __LESF_IPC_ACTION_SERVER_H__
 
 #include "lesf/ipc/endpoint.h"
+#include "lesf/ipc/action_cache.h"
 
 #include <string>
 #include <functional>
+#include <memory>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <vector>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
 
 namespace lesf { namespace ipc {
 
 namespace detail {
+    // Holds a value of either type U or type V. The value is stored inline, so
+    //   this type does not allocate anything by itself.
     template <typename U, typename V>
     class Either
     {
@@ -36,25 +51,52 @@ namespace detail {
 
     public:
         Either(U&& u) :
-            m_u(std::make_shared<U>(std::move(u))),
-            m_v(0)
-        {}
+            m_is_u(true)
+        { new (&m_storage) U(std::move(u)); }
 
         Either(U const& u) :
-            m_u(std::make_shared<U>(u)),
-            m_v(0)
-        {}
+            m_is_u(true)
+        { new (&m_storage) U(u); }
 
         Either(V&& v) :
-            m_u(0),
-            m_v(std::make_shared<V>(std::move(v)))
-        {}
+            m_is_u(false)
+        { new (&m_storage) V(std::move(v)); }
 
         Either(V const& v) :
-            m_u(0),
-            m_v(std::make_shared<V>(v))
-        {}
+            m_is_u(false)
+        { new (&m_storage) V(v); }
+
+        Either(Either const& other) :
+            m_is_u(other.m_is_u)
+        {
+            if (m_is_u)
+                new (&m_storage) U(other.M_get(type<U>()));
+            else
+                new (&m_storage) V(other.M_get(type<V>()));
+        }
 
+        Either(Either&& other) :
+            m_is_u(other.m_is_u)
+        {
+            if (m_is_u)
+                new (&m_storage) U(std::move(other.M_get(type<U>())));
+            else
+                new (&m_storage) V(std::move(other.M_get(type<V>())));
+        }
+
+        Either& operator=(Either other)
+        {
+            M_destroy();
+            m_is_u = other.m_is_u;
+            if (m_is_u)
+                new (&m_storage) U(std::move(other.M_get(type<U>())));
+            else
+                new (&m_storage) V(std::move(other.M_get(type<V>())));
+            return *this;
+        }
+
+        ~Either()
+        { M_destroy(); }
 
         template <typename T>
         bool is() const
@@ -64,30 +106,53 @@ namespace detail {
         T const& get() const
         { return M_get(type<T>()); }
 
+        // Mutable access, to allow moving the value out
+        template <typename T>
+        T& get()
+        { return M_get(type<T>()); }
+
     private:
+        void M_destroy()
+        {
+            if (m_is_u)
+                M_get(type<U>()).~U();
+            else
+                M_get(type<V>()).~V();
+        }
+
         template <typename T>
         bool M_is(type<T>) const
         { return false; }
 
         bool M_is(type<U>) const
-        { return m_u != nullptr; }
+        { return m_is_u; }
 
         bool M_is(type<V>) const
-        { return m_v != nullptr; }
+        { return !m_is_u; }
 
         template <typename T>
         T const& M_get(type<T>) const
         { return *static_cast<T const*>(0); }
 
+        template <typename T>
+        T& M_get(type<T>)
+        { return *static_cast<T*>(0); }
+
         U const& M_get(type<U>) const
-        { return *m_u; }
+        { return *reinterpret_cast<U const*>(&m_storage); }
+
+        U& M_get(type<U>)
+        { return *reinterpret_cast<U*>(&m_storage); }
 
         V const& M_get(type<V>) const
-        { return *m_v; }
+        { return *reinterpret_cast<V const*>(&m_storage); }
+
+        V& M_get(type<V>)
+        { return *reinterpret_cast<V*>(&m_storage); }
 
     private:
-        std::shared_ptr<U> m_u;
-        std::shared_ptr<V> m_v;
+        typename std::aligned_union<0, U, V>::type m_storage;
+        bool m_is_u;
     };
 }
 
@@ -111,34 +176,828 @@ public:
     { return this->template get<typename T::Error>(); }
 };
 
+template <typename T>
+class Responder;
+
+template <typename T>
+class StreamWriter;
+
+class ActionServer;
+
+namespace detail {
+    // Flow control of a streaming action (see ipc::StreamWriter)
+    struct StreamState
+    {
+        StreamState(ActionServer& server) :
+            server(server),
+            acked(0),
+            cancelled(false)
+        {}
+
+        // Wait until fewer than ActionServer::StreamWindow of the sent chunks
+        //   are not acknowledged by the client, returns false if the action
+        //   was cancelled meanwhile, or after ActionServer::StreamAckTimeoutMs
+        //   without acknowledgement. The action doesn't count as outstanding
+        //   while waiting (see ActionServer::setMaxOutstanding()).
+        bool waitCredit(unsigned sent);
+        void cancel();
+
+        ActionServer& server;
+        std::mutex mutex;
+        std::condition_variable cond;
+        unsigned acked; // Chunks consumed by the client
+        bool cancelled;
+    };
+
+    struct CancelState
+    {
+        CancelState() :
+            cancelled(false)
+        {}
+
+        std::mutex mutex;
+        std::atomic<bool> cancelled;
+        std::vector<std::function<void()>> callbacks;
+    };
+
+    // The running streams of an action, by id
+    class StreamTable
+    {
+    public:
+        std::shared_ptr<StreamState> open(std::string const& id, ActionServer& server);
+        void close(std::string const& id);
+        void ack(std::string const& id, unsigned count);
+
+    private:
+        std::mutex m_mutex;
+        std::map<std::string, std::shared_ptr<StreamState>> m_streams;
+    };
+}
+
+// Tells whether the client cancelled an action (see T::cancel() in
+//   lesf/ipc/user_actions.h), get it from ActionServer::cancellation(). Handlers
+//   can poll it, or subscribe to be called back from the receiving thread of
+//   the endpoint when the cancellation arrives.
+class CancellationToken
+{
+    friend class ActionServer; // to allow construction
+
+public:
+    bool cancelled() const
+    { return m_state && m_state->cancelled; }
+
+    // The callback is called right away if the action is already cancelled
+    void onCancel(std::function<void()> callback);
+
+private:
+    CancellationToken(std::shared_ptr<detail::CancelState> state) :
+        m_state(std::move(state))
+    {}
+
+private:
+    std::shared_ptr<detail::CancelState> m_state;
+};
+
+// Error codes used in the errors produced by the library itself, rather than
+//   by action handlers (which should use positive codes).
+enum ActionErrorCode
+{
+    ActionDropped = -100, // The server did not complete the action
+    ActionDeadlineExpired = -101, // The deadline set by the client passed before the action was run
+    ActionOverloaded = -102, // The server rejected the action because of its admission limits
+    ActionCancelled = -103, // The client cancelled the action before it was run
+    ActionUnavailable = -104 // The server can't run this kind of action (see ActionServer::registerStreamingAction())
+};
+
+// This class runs user handlers for the actions received on an endpoint, each
+//   in its own thread, or inline for deferred actions (see registerDeferredAction()).
+// When created with a number of worker threads, actions are queued and run by
+//   these threads instead, in order of priority then deadline (earliest first)
+//   then arrival, as set by the client (see withPriority() and withTimeout() in
+//   lesf/ipc/user_actions.h). In all cases, actions whose deadline has passed
+//   when they should start are not run, and fail with ActionDeadlineExpired.
+// To spread actions over several processes, create an ActionServer on the server
+//   endpoint and on each ipc::Endpoint::Worker endpoint attached to it, and limit
+//   the number of outstanding actions of each of them : a busy process stops
+//   taking requests, which are then received by the others.
+// Only one ActionServer can be created on an endpoint (or channel) at a time.
 class ActionServer
 {
+    template <typename T>
+    friend class Responder; // to allow access to M_finish() and M_untrack()
+    friend struct detail::StreamState; // to allow access to M_stall()
+
+private:
+    struct Scheduler; // Queue and worker threads, see action_server.cpp
+
+public:
+    // Admission limits, for all actions or a given action type. Actions received
+    //   beyond any of them are not run, and fail with ActionOverloaded right away
+    //   so that clients can back off. 0 means no limit (the default).
+    // Rejections are dropped while Endpoint::MaxPostedMessages responses are
+    //   waiting for the client to read them : it then gets no response at all.
+    struct Limits
+    {
+        unsigned max_queued; // Actions waiting for a worker thread
+        unsigned max_in_flight; // Actions running (or pending, for deferred actions)
+        unsigned max_delay_ms; // Estimated time before a worker thread is available
+    };
+
+    // Counters, for all actions or a given action type
+    struct Stats
+    {
+        unsigned queued;
+        unsigned in_flight;
+        std::uint64_t accepted;
+        std::uint64_t rejected; // Because of the limits
+        std::uint64_t expired; // Because of their deadline
+        std::uint64_t completed;
+        std::uint64_t cancelled; // Before they were run
+        std::uint64_t cache_hits; // Answered from the cache, without running
+        std::uint64_t coalesced; // Answered with the result of an identical running action
+        double avg_run_ms; // Moving average of the run time of (non deferred) actions
+        double estimated_delay_ms; // Estimated queueing delay, as checked against max_delay_ms
+    };
+
+    // Chunks of a streaming action sent ahead of the client, which acknowledges
+    //   them by halves of this window
+    static const unsigned StreamWindow = 16;
+
+    // Time a streaming action waits for the client to acknowledge its chunks
+    //   before giving up (see ipc::StreamWriter::write())
+    static const unsigned StreamAckTimeoutMs = 10000;
+
 public:
-    ActionServer(Endpoint& ep);
+    ActionServer(Endpoint& ep, unsigned workers = 0);
+
+    // Stop handling actions : the handlers are unregistered from the endpoint,
+    //   running actions are cancelled (see cancellation()) and waited for, and
+    //   queued ones fail with ActionDropped.
     ~ActionServer();
 
+    // Set the maximum number of actions handled at once, whether queued, running
+    //   or pending (0 means no limit, the default). Beyond it, the endpoint stops
+    //   taking messages until an action completes : they are left to its workers
+    //   (see ipc::Endpoint::Worker), or the client waits when sending. Nothing
+    //   else is received on the endpoint meanwhile, cancellations included, so
+    //   deferred actions must not wait for another message to complete. Streaming
+    //   actions waiting for acknowledgements are not counted, so that they can
+    //   be received (more actions are then handled at once).
+    void setMaxOutstanding(unsigned max);
+
+    // Set the admission limits for all actions, or for actions of type T.
+    void setLimits(Limits const& limits);
+
+    template <typename T>
+    void setLimits(Limits const& limits)
+    { M_setLimits(M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>()), limits); }
+
+    // Get the counters for all actions, or for actions of type T.
+    Stats stats() const;
+
+    template <typename T>
+    Stats stats()
+    { return M_stats(M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>())); }
+
+    template <typename T>
+    using Handler = std::function<ResponseOrError<T>(typename T::Params const&, std::string const&)>;
+
     template <typename T>
-    void registerAction(std::function<ResponseOrError<T>(typename T::Params const&, std::string const&)> handler)
+    using BatchHandler = std::function<std::vector<ResponseOrError<T>>(std::vector<typename T::Params> const&, std::string const&)>;
+
+    // Register a handler for an action. Batches of this action (see T::batch())
+    //   are handled by calling it for each of their actions in turn, unless a
+    //   batch handler is registered.
+    // If the action is declared cacheable in the .def file, its responses are
+    //   memoized (see ipc::ActionCachePolicy), and identical requests received
+    //   while it runs share its result (including errors returned by the
+    //   handler) instead of running again. If it does not run (because of its
+    //   deadline, a cancellation or the limits), the first of them runs instead.
+    //   Requests waiting for an identical action don't count against the
+    //   admission limits, but fail with ActionDeadlineExpired right away if
+    //   their deadline already passed. Batches are not cached.
+    template <typename T>
+    void registerAction(Handler<T> handler)
     {
-        m_ep.registerSlot<typename T::ActionData>(
-            [handler](Endpoint& ep, typename T::ActionData const& action)
+        // Shared by the threads running the action, instead of copied for each of them
+        auto shared_handler = std::make_shared<Handler<T>>(std::move(handler));
+        ActionStats* stats = M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>());
+
+        std::shared_ptr<detail::ActionCache<T>> cache;
+        if (T::cachePolicy().max_entries)
+            cache = std::make_shared<detail::ActionCache<T>>(T::cachePolicy());
+
+        M_registerSlot<typename T::ActionData>(
+            [this, shared_handler, stats, cache](Endpoint& ep, typename T::ActionData&& action)
             {
-                std::thread([&ep, handler, action]()
+                if (cache)
+                    return M_handleCached<T>(ep, stats, shared_handler, cache, std::move(action));
+
+                M_handle(stats, std::move(action),
+                    [this, &ep, shared_handler, stats](typename T::ActionData&& action)
+                    { M_run<T>(ep, stats, *shared_handler, std::move(action)); },
+                    [this, &ep](typename T::ActionData& action, int code, std::string const& message)
+                    { M_reject<T>(ep, std::move(action.id), code, message); });
+            });
+
+        M_registerCancelSlot<T>();
+
+        if (m_batch_actions.count(MessageFactory::typeIdentifier<typename T::BatchActionData>()))
+            return;
+
+        M_registerBatchSlot<T>(std::make_shared<BatchHandler<T>>(
+            [shared_handler](std::vector<typename T::Params> const& params, std::string const& id)
+            {
+                std::vector<ResponseOrError<T>> results;
+                results.reserve(params.size());
+                for (auto const& item : params)
+                    results.push_back((*shared_handler)(item, id));
+                return results;
+            }));
+    }
+
+    // Register a handler for whole batches of an action, to process them in
+    //   one pass. It must return one result per action of the batch, in order.
+    // A batch counts as a single action for scheduling and admission control.
+    template <typename T>
+    void registerBatchAction(BatchHandler<T> handler)
+    {
+        m_batch_actions.insert(MessageFactory::typeIdentifier<typename T::BatchActionData>());
+        M_registerBatchSlot<T>(std::make_shared<BatchHandler<T>>(std::move(handler)));
+        M_registerCancelSlot<T>();
+    }
+
+    template <typename T>
+    using StreamingHandler = std::function<ResponseOrError<T>(typename T::Params const&, std::string const&, StreamWriter<T>&)>;
+
+    // Register a handler for an action producing partial responses (see
+    //   T::stream()), instead of a regular handler. It sends them through the
+    //   given ipc::StreamWriter, then returns the final response (or error).
+    // Each of them must fit in a message, and the handler blocks when it gets
+    //   more than StreamWindow chunks ahead of the client.
+    // The acknowledgements of the client are received by any process serving
+    //   the endpoint, so these actions fail with ActionUnavailable when workers
+    //   are attached to it (see ipc::Endpoint::hasWorkers()).
+    template <typename T>
+    void registerStreamingAction(StreamingHandler<T> handler)
+    {
+        auto shared_handler = std::make_shared<StreamingHandler<T>>(std::move(handler));
+        auto streams = std::make_shared<detail::StreamTable>();
+        ActionStats* stats = M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>());
+
+        M_registerSlot<typename T::ActionData>(
+            [this, shared_handler, streams, stats](Endpoint& ep, typename T::ActionData&& action)
+            {
+                if (ep.hasWorkers())
+                    return M_reject<T>(ep, std::move(action.id), ActionUnavailable, M_unavailableMessage);
+
+                M_handle(stats, std::move(action),
+                    [this, &ep, shared_handler, streams, stats](typename T::ActionData&& action)
+                    {
+                        auto state = streams->open(action.id, *this);
+                        StreamWriter<T> writer(ep, action.id, state);
+
+                        // Don't leave the handler waiting for a client that stopped reading
+                        cancellation(action.id).onCancel([state]() { state->cancel(); });
+
+                        M_run<T>(ep, stats,
+                            [&shared_handler, &writer](typename T::Params const& params, std::string const& id)
+                            { return (*shared_handler)(params, id, writer); },
+                            std::move(action));
+
+                        streams->close(writer.id());
+                    },
+                    [this, &ep](typename T::ActionData& action, int code, std::string const& message)
+                    { M_reject<T>(ep, std::move(action.id), code, message); });
+            });
+
+        M_registerSlot<typename T::StreamAckData>(
+            [streams](Endpoint&, typename T::StreamAckData&& ack) { streams->ack(ack.id, ack.count); });
+
+        M_registerCancelSlot<T>();
+    }
+
+    // Register a handler that does not produce the response itself, but starts
+    //   the action and completes it later, from any thread, through the given
+    //   ipc::Responder. The handler is called from the receiving thread of the
+    //   endpoint and must not block : no thread is used for such actions (nor
+    //   any scheduling), and actions beyond the limits are rejected rather than
+    //   waited for. Responses are posted (see Endpoint::post()), so the handler
+    //   can also complete the action right away.
+    // The ActionServer must outlive the responders of its pending actions.
+    template <typename T>
+    void registerDeferredAction(std::function<void(typename T::Params const&, std::string const&, Responder<T>)> handler)
+    {
+        ActionStats* stats = M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>());
+
+        M_registerSlot<typename T::ActionData>(
+            [this, handler, stats](Endpoint& ep, typename T::ActionData&& action)
+            {
+                if (!M_admit(stats, Running))
+                    return M_reject<T>(ep, std::move(action.id), ActionOverloaded, M_overloadedMessage);
+
+                if (M_expired(action.deadline))
                 {
-                    auto user_res = handler(action.data, action.id);
+                    M_finish(stats, Running, Expired);
+                    return M_reject<T>(ep, std::move(action.id), ActionDeadlineExpired, M_expiredMessage);
+                }
 
-                    if (user_res.template is<typename T::Error>())
-                        ep.send(typename T::ResponseData(action.id, user_res.template get<typename T::Error>()));
-                    else
-                        ep.send(typename T::ResponseData(action.id, user_res.template get<typename T::Response>()));
-                }).detach();
+                M_track(action.id);
+
+                Responder<T> responder(ep, *this, stats, std::move(action.id));
+                handler(action.data, responder.id(), responder);
             });
+
+        M_registerCancelSlot<T>();
     }
 
     static std::string generateId();
 
+    // Get the cancellation token of a running (or queued, or deferred) action,
+    //   from its id. Cancellation messages are received by the endpoint that
+    //   gets them from the client : actions run by another process attached as
+    //   a Worker are not cancelled.
+    CancellationToken cancellation(std::string const& id);
+
+    // Get the deadline of an action started now with the given timeout (in
+    //   milliseconds), as sent on the wire. A null timeout means no deadline.
+    // Deadlines are expressed in milliseconds of the system-wide monotonic clock,
+    //   truncated to 32 bits to fit in JSON integers, and compared modulo 2^32
+    //   (so timeouts must stay well below 24 days).
+    static int deadlineIn(unsigned timeout_ms);
+
+private:
+    struct ActionStats
+    {
+        Limits limits;
+        Stats stats;
+    };
+
+    enum Stage
+    {
+        Queued,
+        Running
+    };
+
+    enum Outcome
+    {
+        Completed,
+        Expired,
+        Cancelled,
+        Dropped
+    };
+
+    // Admit a received action (or batch), then run it in its own thread or
+    //   through the scheduler, or reject it.
+    //   run(Data&&) and reject(Data&, int code, std::string const& message)
+    //   are copied to the thread (or the scheduler)
+    template <typename Data, typename Run, typename Reject>
+    void M_handle(ActionStats* stats, Data&& action, Run run, Reject reject)
+    {
+        Stage stage = m_scheduler ? Queued : Running;
+
+        if (!M_admit(stats, stage))
+            return reject(action, ActionOverloaded, M_overloadedMessage);
+
+        if (M_expired(action.deadline))
+        {
+            M_finish(stats, stage, Expired);
+            return reject(action, ActionDeadlineExpired, M_expiredMessage);
+        }
+
+        // Cancellable until it is done
+        std::string id = action.id;
+        M_track(id);
+
+        if (m_scheduler)
+        {
+            auto shared_action = std::make_shared<Data>(std::move(action));
+
+            M_schedule(shared_action->priority, shared_action->deadline,
+                [this, stats, shared_action, run, id]()
+                {
+                    M_start(stats);
+                    run(std::move(*shared_action));
+                    M_untrack(id);
+                },
+                [this, stats, shared_action, reject, id](int code, std::string const& message)
+                {
+                    M_finish(stats, Queued, Dropped);
+                    reject(*shared_action, code, message);
+                    M_untrack(id);
+                });
+        }
+        else
+        {
+            // Waited for by the destructor
+            M_threadStarted();
+
+            // The received action (and its id) are moved to the thread
+            std::thread([this, run](Data&& action, std::string&& id)
+            {
+                run(std::move(action));
+                M_untrack(id);
+                M_threadDone();
+            }, std::move(action), std::move(id)).detach();
+        }
+    }
+
+    // Answer from the cache or with the result of an identical running action
+    //   if possible, or run the action and share its result
+    template <typename T>
+    void M_handleCached(Endpoint& ep, ActionStats* stats, std::shared_ptr<Handler<T>> handler,
+                        std::shared_ptr<detail::ActionCache<T>> cache, typename T::ActionData&& action)
+    {
+        std::string key = T::serializeParams(action.data);
+        typename T::Response response;
+
+        switch (cache->lookup(key, ep, action.id, action.priority, action.deadline,
+                              M_expired(action.deadline), response))
+        {
+        case detail::ActionCache<T>::Hit:
+            // Posted, as we are on the receiving thread
+            M_cached(stats, true);
+            return ep.post(typename T::ResponseData(std::move(action.id), std::move(response)));
+
+        case detail::ActionCache<T>::Coalesced:
+            return M_cached(stats, false);
+
+        case detail::ActionCache<T>::Expired:
+            // Accounted for as an action expiring before it starts
+            if (!M_admit(stats, Running))
+                return M_reject<T>(ep, std::move(action.id), ActionOverloaded, M_overloadedMessage);
+
+            M_finish(stats, Running, Expired);
+            return M_reject<T>(ep, std::move(action.id), ActionDeadlineExpired, M_expiredMessage);
+
+        case detail::ActionCache<T>::Miss:
+            break;
+        }
+
+        M_runCached<T>(ep, stats, std::move(handler), std::move(cache), std::move(key), std::move(action));
+    }
+
+    // Run an action that missed the cache, and share its result with the
+    //   identical requests received meanwhile
+    template <typename T>
+    void M_runCached(Endpoint& ep, ActionStats* stats, std::shared_ptr<Handler<T>> handler,
+                     std::shared_ptr<detail::ActionCache<T>> cache, std::string key, typename T::ActionData&& action)
+    {
+        M_handle(stats, std::move(action),
+            [this, &ep, handler, stats, cache, key](typename T::ActionData&& action)
+            {
+                std::unique_ptr<ResponseOrError<T>> result;
+
+                M_run<T>(ep, stats,
+                    [&handler, &result](typename T::Params const& params, std::string const& id)
+                    {
+                        result.reset(new ResponseOrError<T>((*handler)(params, id)));
+                        return *result;
+                    }, std::move(action));
+
+                // Not run if its deadline passed meanwhile, or if it was cancelled
+                //   (M_run() only takes the id of the action)
+                if (result)
+                    M_answerWaiters<T>(cache->complete(key, result->isResponse() ? &result->getResponse() : 0), *result);
+                else
+                    M_promoteWaiter<T>(stats, handler, cache, key, std::move(action.data));
+            },
+            [this, &ep, handler, stats, cache, key](typename T::ActionData& action, int code, std::string const& message)
+            {
+                M_reject<T>(ep, std::move(action.id), code, message);
+                M_promoteWaiter<T>(stats, handler, cache, key, std::move(action.data));
+            });
+    }
+
+    // The errors of an action that did not run are its own, run the first
+    //   request waiting for it instead
+    template <typename T>
+    void M_promoteWaiter(ActionStats* stats, std::shared_ptr<Handler<T>> const& handler,
+                         std::shared_ptr<detail::ActionCache<T>> const& cache, std::string const& key,
+                         typename T::Params&& params)
+    {
+        typename detail::ActionCache<T>::Waiter waiter;
+        if (!cache->promote(key, waiter))
+            return;
+
+        M_runCached<T>(*waiter.ep, stats, handler, cache, key,
+                       typename T::ActionData(std::move(waiter.id), std::move(params), waiter.priority, waiter.deadline));
+    }
+
+    template <typename T>
+    void M_answerWaiters(std::vector<typename detail::ActionCache<T>::Waiter> const& waiters, ResponseOrError<T> const& result)
+    {
+        for (auto const& waiter : waiters)
+        {
+            if (result.isError())
+                waiter.ep->send(typename T::ResponseData(waiter.id, result.getError()));
+            else
+                waiter.ep->send(typename T::ResponseData(waiter.id, result.getResponse()));
+        }
+    }
+
+    template <typename T>
+    void M_registerBatchSlot(std::shared_ptr<BatchHandler<T>> shared_handler)
+    {
+        ActionStats* stats = M_actionStats(MessageFactory::typeIdentifier<typename T::ActionData>());
+
+        M_registerSlot<typename T::BatchActionData>(
+            [this, shared_handler, stats](Endpoint& ep, typename T::BatchActionData&& batch)
+            {
+                // Throws from the receiving thread if malformed
+                batch.unpack();
+
+                M_handle(stats, std::move(batch),
+                    [this, &ep, shared_handler, stats](typename T::BatchActionData&& batch)
+                    { M_runBatch<T>(ep, stats, *shared_handler, std::move(batch)); },
+                    [this, &ep](typename T::BatchActionData& batch, int code, std::string const& message)
+                    { M_rejectBatch<T>(ep, std::move(batch.id), batch.data.size(), code, message); });
+            });
+    }
+
+    // Run the handler and send its result, the id and the result are moved
+    //   to the response
+    template <typename T>
+    void M_run(Endpoint& ep, ActionStats* stats, Handler<T> const& handler, typename T::ActionData&& action)
+    {
+        if (M_expired(action.deadline))
+        {
+            M_finish(stats, Running, Expired);
+            return M_reject<T>(ep, std::move(action.id), ActionDeadlineExpired, M_expiredMessage);
+        }
+
+        if (cancellation(action.id).cancelled())
+        {
+            M_finish(stats, Running, Cancelled);
+            return M_reject<T>(ep, std::move(action.id), ActionCancelled, M_cancelledMessage);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto user_res = handler(action.data, action.id);
+        auto run_time = std::chrono::steady_clock::now() - start;
+
+        if (user_res.template is<typename T::Error>())
+            ep.send(typename T::ResponseData(std::move(action.id), std::move(user_res.template get<typename T::Error>())));
+        else
+            ep.send(typename T::ResponseData(std::move(action.id), std::move(user_res.template get<typename T::Response>())));
+
+        M_finish(stats, Running, Completed, run_time);
+    }
+
+    template <typename T>
+    void M_runBatch(Endpoint& ep, ActionStats* stats, BatchHandler<T> const& handler, typename T::BatchActionData&& batch)
+    {
+        std::size_t count = batch.data.size();
+
+        if (M_expired(batch.deadline))
+        {
+            M_finish(stats, Running, Expired);
+            return M_rejectBatch<T>(ep, std::move(batch.id), count, ActionDeadlineExpired, M_expiredMessage);
+        }
+
+        if (cancellation(batch.id).cancelled())
+        {
+            M_finish(stats, Running, Cancelled);
+            return M_rejectBatch<T>(ep, std::move(batch.id), count, ActionCancelled, M_cancelledMessage);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto results = handler(batch.data, batch.id);
+        auto run_time = std::chrono::steady_clock::now() - start;
+
+        // Don't let a faulty handler leave actions without a response
+        if (results.size() > count)
+            results.erase(results.begin() + count, results.end());
+        while (results.size() < count)
+            results.push_back(typename T::Error("no result from the batch handler", ActionDropped));
+
+        ep.send(typename T::BatchResponseData(std::move(batch.id), std::move(results)));
+
+        M_finish(stats, Running, Completed, run_time);
+    }
+
+    // Answer with an error instead of running the action. Rejections are
+    //   mostly sent from the receiving thread of the endpoint, so they are
+    //   posted rather than sent, and dropped if the client is too far behind
+    //   (see Endpoint::tryPost()) so that they can't pile up.
+    template <typename T>
+    void M_reject(Endpoint& ep, std::string id, int code, std::string const& message)
+    {
+        ep.tryPost(typename T::ResponseData(std::move(id), typename T::Error(message, code)));
+    }
+
+    template <typename T>
+    void M_rejectBatch(Endpoint& ep, std::string id, std::size_t count, int code, std::string const& message)
+    {
+        std::vector<ResponseOrError<T>> results(count, typename T::Error(message, code));
+        ep.tryPost(typename T::BatchResponseData(std::move(id), std::move(results)));
+    }
+
+    // Queue an action for the worker threads, reject() is called instead of
+    //   run() if the action can't be run
+    void M_schedule(int priority, int deadline, std::function<void()> run,
+                    std::function<void(int, std::string const&)> reject);
+
+    static bool M_expired(int deadline);
+
+    static const char* const M_overloadedMessage;
+    static const char* const M_unavailableMessage;
+    static const char* const M_expiredMessage;
+    static const char* const M_cancelledMessage;
+
+    // Make an action cancellable, until it is untracked
+    void M_track(std::string const& id);
+    void M_untrack(std::string const& id);
+    void M_cancel(std::string const& id);
+
+    // Register a slot on the endpoint, unregistered by the destructor
+    template <typename T>
+    void M_registerSlot(std::function<void(Endpoint&, T&&)> const& handler)
+    {
+        m_ep.registerConsumingSlot<T>(handler);
+
+        Endpoint& ep = m_ep;
+        m_slots.push_back([&ep]() { ep.unregisterSlot<T>(); });
+    }
+
+    template <typename T>
+    void M_registerCancelSlot()
+    {
+        M_registerSlot<typename T::CancelData>(
+            [this](Endpoint&, typename T::CancelData&& cancel) { M_cancel(cancel.id); });
+    }
+
+    // Get the counters of an action type, created on first use
+    ActionStats* M_actionStats(std::string const& id);
+    void M_setLimits(ActionStats* stats, Limits const& limits);
+    Stats M_stats(ActionStats const* stats) const;
+
+    // Account for an action through its life : admission (returns false if it
+    //   must be rejected, otherwise the action is outstanding), start for queued
+    //   actions, then end (which also releases the outstanding action). Only
+    //   actions run by the server give a run time, used to estimate the queueing
+    //   delay.
+    bool M_admit(ActionStats* stats, Stage stage);
+    void M_start(ActionStats* stats);
+    void M_cached(ActionStats* stats, bool hit);
+    void M_finish(ActionStats* stats, Stage stage, Outcome outcome,
+                  std::chrono::steady_clock::duration run_time = std::chrono::steady_clock::duration::zero());
+
+    void M_releaseOutstanding();
+
+    // Account for the streams waiting for acknowledgements (see setMaxOutstanding())
+    void M_stall(bool stalled);
+
+    // Account for the threads running actions without scheduler
+    void M_threadStarted();
+    void M_threadDone();
+
+private:
+    Endpoint& m_ep;
+    Scheduler* m_scheduler;
+    unsigned m_workers;
+    std::set<std::string> m_batch_actions; // Actions with a batch handler
+    std::vector<std::function<void()>> m_slots; // Unregister each slot of the endpoint
+
+    std::mutex m_cancel_mutex; // Protect m_cancels
+    std::map<std::string, std::shared_ptr<detail::CancelState>> m_cancels; // Running actions
+
+    mutable std::mutex m_outstanding_mutex; // Protect everything below
+    unsigned m_outstanding;
+    unsigned m_max_outstanding;
+    unsigned m_stalled; // Outstanding actions waiting for stream acknowledgements
+    std::condition_variable m_threads_cond;
+    unsigned m_threads;
+    ActionStats m_total_stats;
+    std::map<std::string, ActionStats> m_action_stats;
+};
+
+// Completes a deferred action (see ActionServer::registerDeferredAction()). Copies
+//   refer to the same action, and can be used from any thread. If all of them
+//   are destroyed before the action is completed, an error is sent so that the
+//   client does not wait forever.
+template <typename T>
+class Responder
+{
+    friend class ActionServer; // to allow construction
+
+public:
+    // Send the response, or an error. Only the first completion of an action
+    //   is sent, the next ones return false.
+    bool respond(typename T::Response response)
+    { return M_complete(typename T::ResponseData(m_state->id, std::move(response))); }
+
+    bool fail(typename T::Error error)
+    { return M_complete(typename T::ResponseData(m_state->id, std::move(error))); }
+
+    std::string const& id() const
+    { return m_state->id; }
+
+    bool done() const
+    { return m_state->done; }
+
+private:
+    struct State
+    {
+        State(Endpoint& ep, ActionServer& server, ActionServer::ActionStats* stats, std::string id) :
+            ep(ep),
+            server(server),
+            stats(stats),
+            id(std::move(id)),
+            done(false)
+        {}
+
+        ~State()
+        {
+            if (done.exchange(true))
+                return;
+
+            try {
+                ep.post(typename T::ResponseData(id, typename T::Error("action dropped without response", ActionDropped)));
+            } catch (core::RecoverableException const&) {
+                // Nothing else to do, we can't throw from here
+            }
+
+            server.M_finish(stats, ActionServer::Running, ActionServer::Dropped);
+            server.M_untrack(id);
+        }
+
+        Endpoint& ep;
+        ActionServer& server;
+        ActionServer::ActionStats* stats;
+        std::string id;
+        std::atomic<bool> done;
+    };
+
+    Responder(Endpoint& ep, ActionServer& server, ActionServer::ActionStats* stats, std::string id) :
+        m_state(std::make_shared<State>(ep, server, stats, std::move(id)))
+    {}
+
+    bool M_complete(typename T::ResponseData const& data)
+    {
+        if (m_state->done.exchange(true))
+            return false;
+
+        // The action is no longer outstanding, even if sending fails
+        struct releaser {
+            releaser(State& state) : state(state) {}
+            ~releaser()
+            {
+                state.server.M_finish(state.stats, ActionServer::Running, ActionServer::Completed);
+                state.server.M_untrack(state.id);
+            }
+            State& state;
+        } _releaser(*m_state);
+
+        m_state->ep.post(data);
+        return true;
+    }
+
+private:
+    std::shared_ptr<State> m_state;
+};
+
+// Sends the partial responses of a streaming action (see
+//   ActionServer::registerStreamingAction()), in order, before its final
+//   response.
+template <typename T>
+class StreamWriter
+{
+    friend class ActionServer; // to allow construction
+
+public:
+    StreamWriter(StreamWriter const&) = delete;
+    StreamWriter& operator=(StreamWriter const&) = delete;
+
+    // Send a partial response, blocks until the client has consumed enough of
+    //   the previous ones. Returns false (without sending) if the action was
+    //   cancelled, or if the client did not acknowledge anything for
+    //   ActionServer::StreamAckTimeoutMs : the handler should then return early.
+    bool write(typename T::Response chunk)
+    {
+        if (!m_state->waitCredit(m_sent))
+            return false;
+
+        m_ep.send(typename T::StreamChunkData(m_id, m_sent++, std::move(chunk)));
+        return true;
+    }
+
+    std::string const& id() const
+    { return m_id; }
+
+private:
+    StreamWriter(Endpoint& ep, std::string id, std::shared_ptr<detail::StreamState> state) :
+        m_ep(ep),
+        m_id(std::move(id)),
+        m_state(std::move(state)),
+        m_sent(0)
+    {}
+
 private:
     Endpoint& m_ep;
+    std::string m_id;
+    std::shared_ptr<detail::StreamState> m_state;
+    unsigned m_sent;
 };
 
 } }
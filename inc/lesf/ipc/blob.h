@@ -0,0 +1,184 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_BLOB_H__
+#define __LESF_IPC_BLOB_H__
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstddef>
+
+#include "lconf/json.h"
+
+namespace lesf { namespace ipc {
+
+// A shared memory arena used to carry binary attachments (see ipc::Blob) out of
+//   band of the JSON messages. Each ipc::Endpoint owns one, created by the server
+//   side and opened by the client side.
+// Blocks are allocated by the sender and released by the receiver, so the arena
+//   is accessed concurrently by both processes (allocation is interprocess-safe).
+class BlobArena
+{
+private:
+    class Internals; // Used to hide boost::interprocess stuff from this header
+
+public:
+    // Set the calling thread's current arena for the lifetime of the object.
+    // Blobs extracted from JSON data are resolved against this arena.
+    class Scope
+    {
+    public:
+        Scope(BlobArena* arena);
+        ~Scope();
+
+        Scope(Scope const&) = delete;
+        Scope& operator=(Scope const&) = delete;
+
+        // Number of blobs received in this scope so far
+        std::size_t received() const;
+
+    private:
+        friend class BlobArena; // to allow access to m_arena
+        friend class Blob; // to allow access to m_received
+        BlobArena* m_arena;
+        Scope* m_previous;
+        std::size_t m_received;
+    };
+
+public:
+    // Create (create == true) or open an existing named arena.
+    BlobArena(std::string const& name, std::size_t size, bool create);
+    ~BlobArena();
+
+    BlobArena(BlobArena const&) = delete;
+    BlobArena& operator=(BlobArena const&) = delete;
+
+    // Allocate a block in the arena, throws if there is not enough room.
+    char* allocate(std::size_t size);
+    void deallocate(char* data);
+
+    // Convert between block addresses and their process-independant offsets.
+    std::size_t offsetOf(const char* data) const;
+    char* addressOf(std::size_t offset) const;
+
+    // Get the total size of the arena.
+    std::size_t size() const;
+
+    // Arena of the calling thread, as set by BlobArena::Scope (or null).
+    static BlobArena* current();
+
+private:
+    std::string m_name;
+    bool m_owner;
+    Internals* m_internals;
+};
+
+// A binary attachment for IPC messages, usable as a data member of messages
+//   (LESF_IPC_MEMBERS) or as an ACTION .def field type.
+// The contents live in the blob arena of an endpoint, only their offset and
+//   size are serialized into the message. Use Endpoint::allocateBlob() to get
+//   a writable blob, fill it, and send it. The receiver gets a read-only view
+//   on the same memory, released when the last copy of the received blob is
+//   destroyed. References to blocks that were not handed over (malformed,
+//   duplicated or replayed ones) are rejected when receiving the message.
+// A given blob can be sent only once (ownership is transferred to the receiver),
+//   received blobs can't be sent again, and blobs must not outlive the
+//   endpoint they were allocated from or received on.
+class Blob
+{
+    friend class lconf::json::Terminal<Blob>; // to allow access to M_extract() and M_synthetize()
+
+private:
+    struct Header; // Of the blocks in the arena
+    struct Storage;
+
+public:
+    // Collect the blobs serialized by the calling thread for the lifetime of
+    //   the object, used by endpoints around the sending of a message. The
+    //   blobs are handed over to the receiver on commit(), and stay owned by
+    //   the sender otherwise (if the message could not be sent).
+    // Blobs can't be serialized outside of a transfer.
+    class Transfer
+    {
+    public:
+        Transfer();
+        ~Transfer();
+
+        Transfer(Transfer const&) = delete;
+        Transfer& operator=(Transfer const&) = delete;
+
+        void commit();
+
+        // Whether blobs were serialized in this transfer
+        bool empty() const;
+
+    private:
+        friend class Blob; // to allow access to M_add()
+        void M_add(std::shared_ptr<Storage> const& storage);
+
+    private:
+        Transfer* m_previous;
+        std::vector<std::shared_ptr<Storage>> m_blobs;
+    };
+
+public:
+    Blob();
+    Blob(BlobArena& arena, std::size_t size);
+    ~Blob();
+
+    bool empty() const;
+    std::size_t size() const;
+
+    // Received blobs are read-only, the former returns null for them
+    char* data();
+    const char* data() const;
+
+private:
+    void M_extract(lconf::json::Node* node);
+    lconf::json::Node* M_synthetize() const;
+
+private:
+    std::shared_ptr<Storage> m_storage;
+};
+
+} }
+
+namespace lconf { namespace json {
+
+template <>
+class Terminal<lesf::ipc::Blob> : public UserElement
+{
+public:
+    Terminal(lesf::ipc::Blob& ref) :
+        m_ref(ref)
+    {}
+
+    void extract(Node* node) const
+    { m_ref.M_extract(node); }
+
+    Node* synthetize() const
+    { return m_ref.M_synthetize(); }
+
+private:
+    lesf::ipc::Blob& m_ref;
+};
+
+} }
+
+#endif // __LESF_IPC_BLOB_H__
@@ -0,0 +1,121 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_CAPTURE_H__
+#define __LESF_IPC_CAPTURE_H__
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace lesf { namespace ipc {
+
+class Endpoint;
+
+// Records the frames sent and received by endpoints into a capture file, to be
+//   replayed later with ipc::Replayer :
+//
+// ipc::Capture capture("traffic.cap");
+// ep.setCapture(&capture);
+//
+// Each record holds a timestamp (relative to the creation of the capture), the
+//   direction, the channel, the type identifier and the raw frame. Writes are
+//   buffered, several endpoints can share the same capture.
+// Frames carrying blobs (see ipc::Blob) are left out, as their references can't
+//   be replayed.
+class Capture
+{
+public:
+    enum Direction
+    {
+        Sent = 0,
+        Received = 1
+    };
+
+    struct Record
+    {
+        std::uint64_t timestamp; // Nanoseconds since the start of the capture
+        Direction direction;
+        unsigned channel;
+        std::string type_id;
+        std::string data;
+    };
+
+public:
+    // Create the capture file, throws if it can't be created.
+    Capture(std::string const& path);
+    ~Capture();
+
+    Capture(Capture const&) = delete;
+    Capture& operator=(Capture const&) = delete;
+
+    // Add a record to the capture (thread-safe).
+    void record(Direction direction, unsigned channel, std::string const& type_id, const char* data, std::size_t size);
+
+    // Write buffered records to the file.
+    void flush();
+
+private:
+    std::mutex m_mutex;
+    std::vector<char> m_buffer;
+    std::ofstream m_file;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Reads back the records of a capture file, in order.
+class CaptureReader
+{
+public:
+    // Open the capture file, throws if it is not a valid capture.
+    CaptureReader(std::string const& path);
+
+    // Read the next record, returns false at the end of the capture.
+    // Throws if the capture is truncated.
+    bool next(Capture::Record& record);
+
+private:
+    std::string m_path;
+    std::ifstream m_file;
+};
+
+// Pushes the frames of a capture file into an endpoint, at their original pace,
+//   faster, or as fast as possible. Frames are sent as is, so the message types
+//   don't need to be registered in the replaying process. Captures don't hold
+//   blob references, the receiver rejects any such frame crafted into one.
+class Replayer
+{
+public:
+    Replayer(std::string const& path);
+
+    // Send the recorded frames of the given direction over ep, each on the
+    //   channel it was recorded on (which needs not be opened in this process),
+    //   and return how many were sent. A speed of 2 replays twice as fast as recorded, a speed
+    //   of 0 sends the frames as fast as possible.
+    std::size_t replay(Endpoint& ep, Capture::Direction direction = Capture::Sent, double speed = 1.0);
+
+private:
+    std::string m_path;
+};
+
+} }
+
+#endif // __LESF_IPC_CAPTURE_H__
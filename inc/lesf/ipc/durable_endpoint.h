@@ -0,0 +1,115 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_DURABLE_ENDPOINT_H__
+#define __LESF_IPC_DURABLE_ENDPOINT_H__
+
+#include "lesf/ipc/message.h"
+#include "lesf/ipc/message_factory.h"
+
+#include <string>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstddef>
+
+namespace lesf { namespace ipc {
+
+// This class provides a one-way IPC endpoint backed by a memory-mapped file
+//   instead of shared memory, so that queued messages survive process restarts.
+// Producers append records to a ring buffer in the file, and a single consumer
+//   reads them in order and stores its offset in the file after each message is
+//   handled. A restarted consumer resumes after the last handled message, and
+//   producers can keep sending while the consumer is down, until the file is full.
+// Delivery is at-least-once : a message being handled when the consumer stops is
+//   handled again on restart.
+// Messages can't carry blobs (see ipc::Blob), which live in shared memory.
+class DurableEndpoint
+{
+private:
+    class Internals; // Used to hide boost::interprocess stuff from this header
+
+public:
+    enum Role
+    {
+        Producer,
+        Consumer
+    };
+
+    // Default size of the ring buffer, when the file is created.
+    static const std::size_t DefaultCapacity = 1024UL * 1024UL;
+
+public:
+    // Open the queue stored in the file at path, creating it with the given
+    //   capacity if it does not exist (otherwise the capacity is ignored).
+    // Throws if the file can't be opened or is not a valid queue.
+    DurableEndpoint(Role role, std::string const& path, std::size_t capacity = DefaultCapacity);
+    ~DurableEndpoint();
+
+    DurableEndpoint(DurableEndpoint const&) = delete;
+    DurableEndpoint& operator=(DurableEndpoint const&) = delete;
+
+    // Append a message to the queue (producers only).
+    // Does not wait for the consumer : throws if the queue is full.
+    void send(Message const& msg);
+
+    // Ask the system to write the file contents to disk, so that queued messages
+    //   also survive a system crash. Without this, they survive process
+    //   restarts only.
+    void flush();
+
+    // Register a handler for a particular message type (consumers only). The given
+    //   handler will be called from another thread when a message of this type is received.
+    // Exceptions are handled as for ipc::Endpoint.
+    template <typename T>
+    void registerSlot(std::function<void(DurableEndpoint&, T const&)> const& handler)
+    {
+        auto id = MessageFactory::typeIdentifier<T>();
+        m_slots[id] = [handler](DurableEndpoint& ep, Message const& msg) { handler(ep, dynamic_cast<T const&>(msg)); };
+    }
+
+    // Register an exception handler for the receiving thread.
+    void registerExceptionHandler(std::function<void(core::RecoverableException const&)> const& handler);
+
+    // Start receiving messages (consumers only). This is not done by the
+    //   constructor, so that messages queued while the consumer was down are
+    //   not received before slots are registered.
+    void start();
+
+private:
+    // This method runs in another thread and polls the file for new records
+    void M_receiveThread();
+
+    // Construct a received message and call the associated slot
+    void M_dispatch(const char* data, std::size_t size);
+
+private:
+    Role m_role;
+    std::string m_path;
+
+    Internals* m_internals;
+    std::atomic<bool> m_stop;
+    std::thread m_receive_thread;
+    std::map<std::string, std::function<void(DurableEndpoint&, Message const&)>> m_slots;
+    std::function<void(core::RecoverableException const&)>* m_exc_handler;
+};
+
+} }
+
+#endif // __LESF_IPC_DURABLE_ENDPOINT_H__
@@ -21,42 +21,110 @@
 
 #include "lesf/ipc/message.h"
 #include "lesf/ipc/message_factory.h"
+#include "lesf/ipc/blob.h"
+#include "lesf/ipc/capture.h"
 
 #include <string>
 #include <map>
 #include <thread>
+#include <atomic>
 #include <functional>
+#include <utility>
 
 namespace lesf { namespace ipc {
 
 // This class provides an easy to use named IPC endpoint. Endpoints are system-wide
 //   resources, so be sure to use a unique name.
 // Only one client can be connected to a server endpoint at a time.
+// Worker endpoints (usually in other processes) attach to the server side of an
+//   existing server endpoint. Messages sent by the client are received by whichever
+//   of the server and its workers is available first, and responses from any of
+//   them reach the client, so actions can be spread over processes transparently.
+//   Workers must be destroyed before their server. Receivers wake up periodically
+//   while workers are attached, as they can take each other's wakeups.
+// An endpoint can be split into several logical channels, each with its own
+//   buffers (and thus flow control), slots and exception handler, but sharing
+//   the same shared memory segment and receiving thread. The endpoint created
+//   with a name serves channel 0, use Endpoint(parent, channel) to open the others
+//   on both sides. All of them can be used wherever an Endpoint is expected.
 class Endpoint
 {
+    friend class Replayer; // to allow access to M_sendFrame()
+
 public:
     enum Role
     {
         Server,
-        Client
+        Client,
+        Worker
     };
 
     // Maximum allowed message size.
     static const size_t MaxMessageSize = 4096UL;
 
+    // Posted messages waiting to be sent beyond which tryPost() drops them.
+    static const size_t MaxPostedMessages = 1024UL;
+
+    // Size of the shared memory arena holding blob attachments (see ipc::Blob).
+    static const size_t BlobArenaSize = 16UL * 1024UL * 1024UL;
+
 public:
     // Create a new named IPC endpoint.
     // If role == ipc::Endpoint::Server, throws if name is already used
     // If role == ipc::Endpoint::Client, throws if another client is already connected
-    Endpoint(Role role, std::string const& name);
+    // If role == ipc::Endpoint::Worker, throws if there is no server endpoint with this name
+    // The number of channels is chosen by the server, and ignored for clients.
+    Endpoint(Role role, std::string const& name, unsigned channels = 1);
+
+    // Open another logical channel of an existing endpoint.
+    // Throws if the channel does not exist or is already opened in this process.
+    // Channel endpoints must be destroyed before the endpoint they were opened from.
+    Endpoint(Endpoint& parent, unsigned channel);
 
     // Careful! The destructor of a Server endpoint will block until the client
     //   is detroyed.
     ~Endpoint();
 
+    Endpoint(Endpoint const&) = delete;
+    Endpoint& operator=(Endpoint const&) = delete;
+
+    // Get the channel served by this endpoint, and the number of channels
+    unsigned channel() const;
+    unsigned channels() const;
+
+    // Tell whether other processes receive the messages of the client too :
+    //   this is a worker, or a server with workers attached.
+    bool hasWorkers() const;
+
     // Send a message over the endpoint
     void send(Message const& msg);
 
+    // Queue a message to be sent by another thread, without waiting for the
+    //   peer to take the previous ones. Use it from slots, where send() would
+    //   hold the receiving thread while the peer may itself wait for us to
+    //   receive what it sends.
+    // Posted messages are sent in order, but not in order with the messages
+    //   given to send(), and those still queued when the endpoint is destroyed
+    //   are dropped. Throws right away if the message can't be serialized or
+    //   is too large.
+    void post(Message const& msg);
+
+    // Same as post(), but drop the message and return false if MaxPostedMessages
+    //   are already waiting to be sent, for messages that the peer can do
+    //   without when it can't keep up (such as rejections).
+    bool tryPost(Message const& msg);
+
+    // Allocate a blob attachment of the given size in this endpoint's arena.
+    // Fill it, then use it as a data member of a message sent on this endpoint.
+    Blob allocateBlob(std::size_t size);
+
+    // Record the frames sent and received by this endpoint (and not by the
+    //   other channels) into a capture, or stop recording if null. The capture
+    //   is not owned, and must outlive the endpoint or be unset first.
+    // Messages carrying blobs are not recorded, their references are only
+    //   valid for the blobs handed over when they were sent.
+    void setCapture(Capture* capture);
+
     // Register a handler for a particular message type. The given handler will
     //   be called from another thread when a message of this type is received.
     // Any exception raised from this thread is catched and :
@@ -66,29 +134,98 @@ public:
     void registerSlot(std::function<void(Endpoint&, T const&)> const& handler)
     {
         auto id = MessageFactory::typeIdentifier<T>();
-        m_slots[id] = [handler](Endpoint& ep, Message const& msg) { handler(ep, dynamic_cast<T const&>(msg)); };
+        M_setSlot(id, [handler](Endpoint& ep, Message& msg) { handler(ep, dynamic_cast<T const&>(msg)); });
     }
 
+    // Same as above, but the handler takes ownership of the received message's
+    //   contents (which is destroyed after the handler returns), so that they can
+    //   be moved instead of copied.
+    template <typename T>
+    void registerConsumingSlot(std::function<void(Endpoint&, T&&)> const& handler)
+    {
+        auto id = MessageFactory::typeIdentifier<T>();
+        M_setSlot(id, [handler](Endpoint& ep, Message& msg) { handler(ep, std::move(dynamic_cast<T&>(msg))); });
+    }
+
+    // Remove the handler of a particular message type, if any. When this
+    //   returns, the handler is not running anymore (unless this is called
+    //   from it) and won't be called again.
+    template <typename T>
+    void unregisterSlot()
+    { M_setSlot(MessageFactory::typeIdentifier<T>(), nullptr); }
+
+    // Leave the messages sent to this endpoint to the other receivers (see
+    //   Worker) while gate returns false, instead of taking them. Back-pressure
+    //   for the client, which also can't send anything else on this channel
+    //   meanwhile. The gate is called from the receiving thread, and checked
+    //   again when it polls or on notifyReceiveGate(). Null removes it.
+    void setReceiveGate(std::function<bool()> gate);
+
+    // Tell the receiving thread that the receive gate may be open again.
+    void notifyReceiveGate();
+
     // Register an exception handler for the receiving thread.
     void registerExceptionHandler(std::function<void(core::RecoverableException const&)> const& handler);
 
-private:
-    // This method runs in another thread and wait for anything to be received
-    void M_receiveThread();
-
 private:
     // Some internal data types (see endpoint.cpp for details) to manage shared memory
     struct SharedBuffer;
+    struct SharedDoorbell;
     struct SharedData;
     struct SharedMem;
+    struct Poster;
+
+private:
+    // This method runs in another thread and wait for anything to be received
+    //   (only for the endpoint owning the shared memory, it serves all channels)
+    void M_receiveThread();
+
+    // Check the receive gate of the endpoint of a channel, if any
+    bool M_gateClosed(unsigned channel);
+
+    // Construct a received message, release its shared buffer and call the
+    //   associated slot of this endpoint
+    void M_dispatch(SharedBuffer* buf);
+    void M_releaseBuffer(SharedBuffer* buf);
+
+    // Set the slot of a message type, or remove it if null, without racing
+    //   with the receiving thread
+    void M_setSlot(std::string const& type_id, std::function<void(Endpoint&, Message&)> slot);
+
+    // Send an already serialized message, on the channel of this endpoint or
+    //   on another channel of the same shared memory
+    void M_sendFrame(std::string const& type_id, const char* data, std::size_t size);
+
+    // Queue a message for the posting thread, unless bounded and too many
+    //   messages are waiting already
+    bool M_post(Message const& msg, bool bounded);
+    void M_sendFrame(unsigned channel, std::string const& type_id, const char* data, std::size_t size);
+
+    // Write a frame into a shared buffer, once it is empty
+    void M_writeFrame(SharedBuffer* buf, const char* data, std::size_t size);
+
+    // This method runs in another thread, started on the first call to
+    //   post(), and sends the posted messages
+    void M_postThread();
+    void M_stopPosting();
+
+    // Record a frame into the capture, if any (sent frames are only recorded
+    //   with a type identifier)
+    void M_capture(Capture::Direction direction, unsigned channel, std::string const& type_id, const char* data, std::size_t size);
 
 private:
     Role m_role;
     std::string m_name;
+    Endpoint* m_root; // Endpoint owning the shared memory (this one, unless opened on a channel)
+    unsigned m_channel;
 
     SharedMem* m_shared;
+    BlobArena* m_blobs;
+    std::atomic<Capture*> m_capture;
     std::thread m_receive_thread;
-    std::map<std::string, std::function<void(Endpoint&, Message const&)>> m_slots;
+    Poster* m_poster;
+    std::map<std::string, std::function<void(Endpoint&, Message&)>> m_slots;
+    std::function<bool()> m_receive_gate;
     std::function<void(core::RecoverableException const&)>* m_exc_handler;
 };
 
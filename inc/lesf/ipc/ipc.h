@@ -21,8 +21,15 @@
 
 #include "lesf/ipc/exception.h"
 #include "lesf/ipc/message.h"
+#include "lesf/ipc/pod_message.h"
+#include "lesf/ipc/blob.h"
+#include "lesf/ipc/packed_array.h"
+#include "lesf/ipc/shared_state.h"
 #include "lesf/ipc/message_factory.h"
 #include "lesf/ipc/endpoint.h"
+#include "lesf/ipc/durable_endpoint.h"
+#include "lesf/ipc/capture.h"
+#include "lesf/ipc/action_cache.h"
 #include "lesf/ipc/action_server.h"
 
 #endif // __LESF_IPC_H__
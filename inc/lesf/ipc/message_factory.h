@@ -23,9 +23,13 @@
 #include <map>
 #include <functional>
 #include <type_traits>
+#include <typeindex>
+#include <cstring>
+#include <cstdint>
 
 #include "lesf/ipc/exception.h"
 #include "lesf/ipc/message.h"
+#include "lesf/ipc/pod_message.h"
 
 namespace lesf { namespace ipc {
 
@@ -35,6 +39,8 @@ namespace lesf { namespace ipc {
 //   provides static functions to :
 //     - construct an ipc::Message* from JSON
 //     - serialize an ipc::Message* into JSON
+// ipc::PodMessage<> types bypass JSON and use raw frames instead (see
+//   lesf/ipc/pod_message.h), both functions handle the two representations.
 class MessageFactory
 {
 private:
@@ -43,20 +49,28 @@ private:
 
 public:
     // Register a new concrete message type in the system using the given identifier.
+    // The identifier is written as is in JSON frames, so it can't contain
+    //   quotes, backslashes or control characters.
     template <typename T>
     static void registerMessageType(std::string const& id)
     {
         static_assert(std::is_base_of<Message, T>::value, "Can only be used with types derived from ipc::Message");
 
+        for (char c : id)
+        {
+            if (c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20)
+                LESF_CORE_THROW(TypeException, "identifier `" << id << "` can't be used in JSON frames");
+        }
+
         // Check for double registers
-        if (m_ctors.find(id) != m_ctors.end())
+        if (M_ctors().find(id) != M_ctors().end() || M_rawTypes().find(id) != M_rawTypes().end())
             LESF_CORE_THROW(TypeException, "identifier `" << id << "` is already used");
 
         // Add the RTTI -> identifier entry
-        m_rtti_map[typeid(T).name()] = id;
+        M_rttiMap()[std::type_index(typeid(T))] = id;
 
-        // Create the constructor using a nice lambda
-        m_ctors[id] = [](json::Node* data) -> Message* { return new T(data); };
+        // Create the constructor
+        M_registerConstructor<T>(id, std::is_base_of<detail::PodMessageBase, T>());
     }
 
     // Get the identifier associated with a concrete message type. Throws an exception
@@ -64,32 +78,82 @@ public:
     template <typename T>
     static std::string const& typeIdentifier()
     {
-        auto it = m_rtti_map.find(typeid(T).name());
+        auto it = M_rttiMap().find(std::type_index(typeid(T)));
 
-        if (it == m_rtti_map.end())
+        if (it == M_rttiMap().end())
             LESF_CORE_THROW(TypeException, "type is not registered (RTTI name `" << typeid(T).name() << "`)");
 
         return it->second;
     }
 
+    // Same as above, for the concrete type of a message instance.
+    static std::string const& typeIdentifier(Message const& msg);
+
     // Construct an IPC message instance from plain JSON data.
     // Throws an exception in the input data is not well formatted or if
     //   it used an unknown identifier.
     // Returns the identifier in *id if not null.
     static Message* construct(std::string const& json, std::string* id = 0);
 
+    // Same as above, but parse the JSON data in place from a raw memory span
+    //   (typically the shared memory receive buffer of an ipc::Endpoint),
+    //   without copying it first. The span must stay valid during the call only.
+    static Message* construct(const char* data, std::size_t size, std::string* id = 0);
+
     // Serialize an IPC message instance to JSON data. Throws an exception if the
     //   underlying class is not registered in the system.
     static std::string serialize(Message const& msg);
 
 private:
+    // Registration information for ipc::PodMessage<> types
+    struct RawType
+    {
+        std::uint64_t layout_hash;
+        std::size_t size;
+        std::function<Message*(const char*)> ctor;
+    };
+
+    // Regular messages are constructed from their JSON representation
+    template <typename T>
+    static void M_registerConstructor(std::string const& id, std::false_type)
+    {
+        M_ctors()[id] = [](json::Node* data) -> Message* { return new T(data); };
+    }
+
+    // ipc::PodMessage<> types are copied back from the raw frame payload
+    template <typename T>
+    static void M_registerConstructor(std::string const& id, std::true_type)
+    {
+        M_rawTypes()[id] = RawType
+        {
+            T::layoutHash(),
+            sizeof(T::value),
+            [](const char* data) -> Message*
+            {
+                T* msg = new T();
+                std::memcpy(&msg->value, data, sizeof(msg->value));
+                return msg;
+            }
+        };
+    }
+
+    static Message* M_constructRaw(const char* data, std::size_t size, std::string* id);
+
+private:
+    // The registries below are function-local statics, so that message types
+    //   can safely be registered during static initialization of other modules
+    //   (as done by the ACTION() x-macros).
+
     // Associates RTTI info of a type to its identifier in our system. We could
     //   implement equivalent functionnality without RTTI, but it's cleaner this way.
-    static std::map<std::string, std::string> m_rtti_map;
+    static std::map<std::type_index, std::string>& M_rttiMap();
 
     // Contains a constructor function for each registered type, taking parsed
     //   JSON representation as input to initialize data members.
-    static std::map<std::string, std::function<Message*(json::Node*)>> m_ctors;
+    static std::map<std::string, std::function<Message*(json::Node*)>>& M_ctors();
+
+    // Contains the raw frame information of each registered ipc::PodMessage<> type.
+    static std::map<std::string, RawType>& M_rawTypes();
 };
 
 } }
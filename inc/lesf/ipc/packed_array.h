@@ -0,0 +1,135 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_PACKED_ARRAY_H__
+#define __LESF_IPC_PACKED_ARRAY_H__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+
+#include <boost/algorithm/hex.hpp>
+
+#include "lconf/json.h"
+
+namespace lesf { namespace ipc {
+
+// A std::vector<> of arithmetic values that is serialized as a single packed
+//   block of raw little-endian data (hex encoded in the JSON representation)
+//   instead of a JSON array of decimal text. This is exact for floating point
+//   values and much cheaper to print and parse for large arrays.
+// Use it instead of std::vector<> in LESF_IPC_MEMBERS or ACTION .def fields :
+//
+//   _(ipc::PackedArray<float>, gains)
+template <typename T>
+class PackedArray : public std::vector<T>
+{
+    static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                  "ipc::PackedArray<> can only be used with arithmetic types (except bool)");
+
+public:
+    using std::vector<T>::vector;
+
+    PackedArray()
+    {}
+
+    PackedArray(std::vector<T> const& values) :
+        std::vector<T>(values)
+    {}
+
+    PackedArray(std::vector<T>&& values) :
+        std::vector<T>(std::move(values))
+    {}
+};
+
+namespace detail {
+    // Convert between host and little-endian byte order, in place.
+    template <typename T>
+    void swapLittleEndian(T* values, std::size_t count)
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            char* bytes = reinterpret_cast<char*>(values + i);
+            std::reverse(bytes, bytes + sizeof(T));
+        }
+#else
+        (void) values;
+        (void) count;
+#endif
+    }
+}
+
+} }
+
+namespace lconf { namespace json {
+
+template <typename T>
+class Terminal<lesf::ipc::PackedArray<T>> : public UserElement
+{
+public:
+    Terminal(lesf::ipc::PackedArray<T>& ref) :
+        m_ref(ref)
+    {}
+
+    void extract(Node* node) const
+    {
+        StringNode* str = node->downcast<StringNode>();
+        if (!str)
+            throw lconf::json::Exception(node, "packed array must be a string");
+
+        std::string const& as_hex = str->value();
+        if (as_hex.size() % (2 * sizeof(T)))
+            throw lconf::json::Exception(node, "invalid packed array size");
+
+        // Decode straight into the vector storage
+        m_ref.resize(as_hex.size() / (2 * sizeof(T)));
+        try {
+            boost::algorithm::unhex(as_hex.begin(), as_hex.end(), reinterpret_cast<char*>(m_ref.data()));
+        } catch (boost::algorithm::hex_decode_error const&) {
+            throw lconf::json::Exception(node, "invalid packed array data");
+        }
+
+        lesf::ipc::detail::swapLittleEndian(m_ref.data(), m_ref.size());
+    }
+
+    Node* synthetize() const
+    {
+        const char* raw = reinterpret_cast<const char*>(m_ref.data());
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        std::vector<T> swapped(m_ref);
+        lesf::ipc::detail::swapLittleEndian(swapped.data(), swapped.size());
+        raw = reinterpret_cast<const char*>(swapped.data());
+#endif
+
+        std::string as_hex;
+        as_hex.reserve(2 * sizeof(T) * m_ref.size());
+        boost::algorithm::hex(raw, raw + sizeof(T) * m_ref.size(), std::back_inserter(as_hex));
+
+        return new StringNode(as_hex);
+    }
+
+private:
+    lesf::ipc::PackedArray<T>& m_ref;
+};
+
+} }
+
+#endif // __LESF_IPC_PACKED_ARRAY_H__
@@ -0,0 +1,134 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_POD_MESSAGE_H__
+#define __LESF_IPC_POD_MESSAGE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+#include "lesf/ipc/message.h"
+
+namespace lesf { namespace ipc {
+
+class MessageFactory;
+
+// Fixed-size messages made of plain data (counters, coordinates, flags, ...) do
+//   not need to go through JSON templating. Wrap such a trivially copyable type
+//   into an ipc::PodMessage<> and register it as usual :
+//
+// struct Coords { float x, y; };
+// LESF_IPC_POD_LAYOUT(Coords, float x, float y) // optional, see below
+//
+// MessageFactory::registerMessageType<PodMessage<Coords>>("coords");
+// ep.registerSlot<PodMessage<Coords>>(
+//     [](Endpoint&, PodMessage<Coords> const& msg) { use(msg.value.x); });
+// ep.send(PodMessage<Coords>({1.f, 2.f}));
+//
+// These messages are sent as a raw copy of the value, tagged with a hash of the
+//   type's layout computed at compile time. The receiver checks the hash before
+//   copying the bytes back, and throws an ipc::TypeException on mismatch.
+// By default the hash only covers the size and alignment of the type. Use
+//   LESF_IPC_POD_LAYOUT() to also cover a description of its fields, so that a
+//   reordering or a change of types between two builds is detected as well.
+// As with other raw memory copies, both sides must run on the same architecture.
+
+template <typename T>
+struct PodLayout
+{
+    static constexpr const char* description()
+    { return ""; }
+};
+
+#define LESF_IPC_POD_LAYOUT(type, ...) \
+    namespace lesf { namespace ipc { \
+        template <> \
+        struct PodLayout<type> \
+        { \
+            static constexpr const char* description() \
+            { return #__VA_ARGS__; } \
+        }; \
+    } }
+
+namespace detail {
+    // 64-bit FNV-1a, usable in constant expressions
+    constexpr std::uint64_t fnv1aOffsetBasis = 14695981039346656037ULL;
+    constexpr std::uint64_t fnv1aPrime = 1099511628211ULL;
+
+    constexpr std::uint64_t fnv1a(const char* str, std::uint64_t hash = fnv1aOffsetBasis)
+    { return *str ? fnv1a(str + 1, (hash ^ static_cast<unsigned char>(*str)) * fnv1aPrime) : hash; }
+
+    constexpr std::uint64_t fnv1a(std::uint64_t value, std::uint64_t hash, int bytes = 8)
+    { return bytes ? fnv1a(value >> 8, (hash ^ (value & 0xFF)) * fnv1aPrime, bytes - 1) : hash; }
+
+    // Non-template base class of all ipc::PodMessage<> types, this is what
+    //   MessageFactory looks for when serializing.
+    class PodMessageBase : public Message
+    {
+        friend class lesf::ipc::MessageFactory; // to allow access to M_raw*()
+
+    protected:
+        // Not used, these messages never go through JSON
+        json::Template M_jsonTemplate()
+        { return json::Template(); }
+
+        virtual const void* M_rawData() const = 0;
+        virtual std::size_t M_rawSize() const = 0;
+        virtual std::uint64_t M_layoutHash() const = 0;
+    };
+}
+
+template <typename T>
+class PodMessage : public detail::PodMessageBase
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ipc::PodMessage<> can only be used with trivially copyable types");
+
+public:
+    PodMessage() :
+        value()
+    {}
+
+    PodMessage(T const& value) :
+        value(value)
+    {}
+
+    static constexpr std::uint64_t layoutHash()
+    {
+        return detail::fnv1a(PodLayout<T>::description(),
+                             detail::fnv1a(alignof(T),
+                                           detail::fnv1a(sizeof(T), detail::fnv1aOffsetBasis)));
+    }
+
+public:
+    T value;
+
+protected:
+    const void* M_rawData() const
+    { return &value; }
+
+    std::size_t M_rawSize() const
+    { return sizeof(T); }
+
+    std::uint64_t M_layoutHash() const
+    { return layoutHash(); }
+};
+
+} }
+
+#endif // __LESF_IPC_POD_MESSAGE_H__
@@ -0,0 +1,130 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LESF_IPC_SHARED_STATE_H__
+#define __LESF_IPC_SHARED_STATE_H__
+
+#include <string>
+#include <functional>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+#include "lesf/ipc/pod_message.h"
+
+namespace lesf { namespace ipc {
+
+// A typed value published by one process (the writer) and read by any number of
+//   processes (the readers) straight from shared memory, with no message
+//   exchanged. This is meant for state that clients would otherwise poll for
+//   with actions :
+//
+// struct CameraState { float zoom; int exposure; };
+// LESF_IPC_POD_LAYOUT(CameraState, float zoom, int exposure) // optional
+//
+// SharedState<CameraState> state(SharedState<CameraState>::Writer, "camera_state");
+// state.write({2.f, 100});
+//
+// SharedState<CameraState> state(SharedState<CameraState>::Reader, "camera_state");
+// float zoom = state.read().zoom;
+// state.subscribe([](CameraState const& s) { use(s.zoom); });
+//
+// Writes are protected by a sequence lock : readers copy the value and retry if
+//   it was written meanwhile, so reads take no lock and never block the writer.
+// The type must be trivially copyable. Readers check it against the writer's
+//   layout hash when opening the state, as for ipc::PodMessage<>.
+// Subscribers are notified from a dedicated thread with the latest value, so
+//   intermediate values are skipped when writes are faster than the handlers.
+
+namespace detail {
+    // Non-template part of ipc::SharedState<>, working on raw bytes
+    class SharedStateBase
+    {
+    private:
+        class Internals; // Used to hide boost::interprocess stuff from this header
+
+    public:
+        enum Role
+        {
+            Writer,
+            Reader
+        };
+
+        // Alignment of the value in shared memory
+        static const std::size_t MaxAlignment = 64;
+
+    protected:
+        // The writer creates the state with the given initial value, readers
+        //   open an existing one and throw if it does not exist or has another layout.
+        SharedStateBase(Role role, std::string const& name, std::size_t size, std::uint64_t layout_hash, const void* initial);
+        ~SharedStateBase();
+
+        SharedStateBase(SharedStateBase const&) = delete;
+        SharedStateBase& operator=(SharedStateBase const&) = delete;
+
+        void M_write(const void* value);
+        void M_read(void* value) const;
+        void M_subscribe(std::function<void()> const& handler);
+
+    public:
+        Role role() const;
+        std::string const& name() const;
+
+        // Number of writes since the state was created
+        std::uint64_t version() const;
+
+    private:
+        Role m_role;
+        std::string m_name;
+        std::size_t m_size;
+        Internals* m_internals;
+    };
+}
+
+template <typename T>
+class SharedState : public detail::SharedStateBase
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ipc::SharedState<> can only be used with trivially copyable types");
+    static_assert(alignof(T) <= MaxAlignment, "ipc::SharedState<> type is over-aligned");
+
+public:
+    SharedState(Role role, std::string const& name, T const& initial = T()) :
+        detail::SharedStateBase(role, name, sizeof(T), PodMessage<T>::layoutHash(), &initial)
+    {}
+
+    // Publish a new value, only allowed for the writer
+    void write(T const& value)
+    { M_write(&value); }
+
+    // Get a consistent snapshot of the current value
+    T read() const
+    {
+        T value;
+        M_read(&value);
+        return value;
+    }
+
+    // Call handler with the current value each time it changes. Handlers are
+    //   called from a thread owned by this object, until it is destroyed.
+    void subscribe(std::function<void(T const&)> const& handler)
+    { M_subscribe([this, handler]() { handler(read()); }); }
+};
+
+} }
+
+#endif // __LESF_IPC_SHARED_STATE_H__
@@ -27,7 +27,9 @@
 #include <functional>
 #include <set>
 #include <map>
+#include <vector>
 #include <mutex>
+#include <type_traits>
 
 #include "lconf/json.h"
 
@@ -42,6 +44,10 @@
  * Users of the library should define their actions in a user.def file, and define the
  *  LESF_IPC_USER_ACTIONS_DEF accordingly.
  *
+ * Actions can be given options after their response, see ACTION_OPTION_* below :
+ *
+ *   ACTION(camera, GetCapabilities, PARAMS(...), RESPONSE(...), CACHE(1000, 64))
+ *
  * Please note that users should also include lesf/ipc/user_actions_symbols.h once in a
  *   compiled module in order to instanciate static class symbols.
  */
@@ -118,11 +124,147 @@
 
 /////////
 
-#define ACTION(_ns, _name, _params, _response) \
+// Batches are sent column-wise, one array per member
+
+#define COLUMNS_IMPL__(_type, _name) \
+    std::vector<_type> _name;
+
+#define COLUMNS_IMPL_EACH(_decl) \
+    COLUMNS_IMPL_ ## _decl
+
+#define COLUMNS_FOREACH(...) \
+    __VA_OPT__( \
+        LESF_CORE_PREPROCESSOR_EVAL( \
+            LESF_CORE_PREPROCESSOR_MAP( \
+                COLUMNS_IMPL_EACH, \
+                __VA_ARGS__)))
+
+#define COLUMNS_PARAMS(...) \
+    COLUMNS_FOREACH(__VA_ARGS__)
+
+#define COLUMNS_RESPONSE(...) \
+    COLUMNS_FOREACH(__VA_ARGS__)
+
+#define COLUMNS(_params_or_response) \
+    COLUMNS_ ## _params_or_response
+
+/////////
+
+#define COLUMN_REFLIST_IMPL__(_type, _name) \
+    , columns._name
+
+#define COLUMN_REFLIST_IMPL_EACH(_decl) \
+    COLUMN_REFLIST_IMPL_ ## _decl
+
+#define COLUMN_REFLIST_FOREACH(...) \
+    __VA_OPT__( \
+        LESF_CORE_PREPROCESSOR2_EVAL( \
+            LESF_CORE_PREPROCESSOR2_MAP( \
+                COLUMN_REFLIST_IMPL_EACH, \
+                __VA_ARGS__)))
+
+#define COLUMN_REFLIST_PARAMS(...) \
+    COLUMN_REFLIST_FOREACH(__VA_ARGS__)
+
+#define COLUMN_REFLIST_RESPONSE(...) \
+    COLUMN_REFLIST_FOREACH(__VA_ARGS__)
+
+#define COLUMN_REFLIST(_params_or_response) \
+    COLUMN_REFLIST_ ## _params_or_response
+
+/////////
+
+#define COLUMN_PUSH_IMPL__(_type, _name) \
+    columns._name.push_back(std::move(item._name));
+
+#define COLUMN_PUSH_IMPL_EACH(_decl) \
+    COLUMN_PUSH_IMPL_ ## _decl
+
+#define COLUMN_PUSH_FOREACH(...) \
+    __VA_OPT__( \
+        LESF_CORE_PREPROCESSOR_EVAL( \
+            LESF_CORE_PREPROCESSOR_MAP( \
+                COLUMN_PUSH_IMPL_EACH, \
+                __VA_ARGS__)))
+
+#define COLUMN_PUSH_PARAMS(...) \
+    COLUMN_PUSH_FOREACH(__VA_ARGS__)
+
+#define COLUMN_PUSH_RESPONSE(...) \
+    COLUMN_PUSH_FOREACH(__VA_ARGS__)
+
+#define COLUMN_PUSH(_params_or_response) \
+    COLUMN_PUSH_ ## _params_or_response
+
+/////////
+
+#define COLUMN_PULL_IMPL__(_type, _name) \
+    if (columns._name.size() != count) \
+        return false; \
+    item._name = std::move(columns._name[i]);
+
+#define COLUMN_PULL_IMPL_EACH(_decl) \
+    COLUMN_PULL_IMPL_ ## _decl
+
+#define COLUMN_PULL_FOREACH(...) \
+    __VA_OPT__( \
+        LESF_CORE_PREPROCESSOR_EVAL( \
+            LESF_CORE_PREPROCESSOR_MAP( \
+                COLUMN_PULL_IMPL_EACH, \
+                __VA_ARGS__)))
+
+#define COLUMN_PULL_PARAMS(...) \
+    COLUMN_PULL_FOREACH(__VA_ARGS__)
+
+#define COLUMN_PULL_RESPONSE(...) \
+    COLUMN_PULL_FOREACH(__VA_ARGS__)
+
+#define COLUMN_PULL(_params_or_response) \
+    COLUMN_PULL_ ## _params_or_response
+
+/////////
+
+// Tells whether one of the members is a blob (see ipc::Blob)
+
+#define HAS_BLOB_IMPL__(_type, _name) \
+    || std::is_same<_type, lesf::ipc::Blob>::value
+
+#define HAS_BLOB_IMPL_EACH(_decl) \
+    HAS_BLOB_IMPL_ ## _decl
+
+#define HAS_BLOB_FOREACH(...) \
+    __VA_OPT__( \
+        LESF_CORE_PREPROCESSOR_EVAL( \
+            LESF_CORE_PREPROCESSOR_MAP( \
+                HAS_BLOB_IMPL_EACH, \
+                __VA_ARGS__)))
+
+#define HAS_BLOB_PARAMS(...) \
+    HAS_BLOB_FOREACH(__VA_ARGS__)
+
+#define HAS_BLOB_RESPONSE(...) \
+    HAS_BLOB_FOREACH(__VA_ARGS__)
+
+#define HAS_BLOB(_params_or_response) \
+    (false HAS_BLOB_ ## _params_or_response)
+
+/////////
+
+// Options of ACTION, after RESPONSE(...) :
+//   CACHE(ttl_ms, max_entries) : the action is a pure function of its parameters,
+//     its responses can be memoized by the server (see ipc::ActionCachePolicy).
+//     Actions with blob parameters or responses can't be cached, as blobs are
+//     handed over to a single receiver.
+#define ACTION_OPTION_CACHE(_ttl_ms, _max_entries) \
+    _ttl_ms, _max_entries
+
+#define ACTION(_ns, _name, _params, _response, ...) \
 namespace lesf { namespace ipc { namespace user { namespace _ns { \
     class _name \
     { \
         friend class lesf::ipc::ActionServer; \
+        friend class lesf::ipc::Responder<_name>; \
+        friend class lesf::ipc::StreamWriter<_name>; \
         \
     public: \
         struct Params \
@@ -147,21 +289,27 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
         }; \
         \
         typedef std::function<void(ResponseOrError<_name> const&, std::string const&)> ResponseHandler; \
+        typedef std::function<void(std::vector<ResponseOrError<_name>> const&, std::string const&)> BatchResponseHandler; \
+        typedef std::function<void(Response const&, std::string const&)> ChunkHandler; \
         \
     private: \
         class ActionData : public ipc::Message \
         { \
             LESF_IPC_MESSAGE(ActionData) \
-            LESF_IPC_MEMBERS(id REFLIST(_params)) \
+            LESF_IPC_MEMBERS(id, priority, deadline REFLIST(_params)) \
             \
         public: \
-            ActionData(std::string const& id, Params const& data) : \
-                id(id), \
-                data(data) \
+            ActionData(std::string id, Params data, int priority = 0, int deadline = 0) : \
+                id(std::move(id)), \
+                priority(priority), \
+                deadline(deadline), \
+                data(std::move(data)) \
             {} \
             \
         public: \
             std::string id; \
+            int priority; /* Higher runs first */ \
+            int deadline; /* See ActionServer::deadlineIn(), or 0 */ \
             Params data; \
         }; \
         \
@@ -170,14 +318,14 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
             LESF_IPC_MESSAGE(ResponseData) \
             LESF_IPC_MEMBERS(id, error.set, error.message, error.code REFLIST(_response)) \
         public: \
-            ResponseData(std::string const& id, Response const& data) : \
-                id(id), \
+            ResponseData(std::string id, Response data) : \
+                id(std::move(id)), \
                 error(), \
-                data(data) \
+                data(std::move(data)) \
             {} \
-            ResponseData(std::string const& id, Error const& error) : \
-                id(id), \
-                error(error), \
+            ResponseData(std::string id, Error error) : \
+                id(std::move(id)), \
+                error(std::move(error)), \
                 data{} \
             {} \
             \
@@ -187,6 +335,175 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
             Response data; \
         }; \
         \
+        class StreamChunkData : public ipc::Message \
+        { \
+            LESF_IPC_MESSAGE(StreamChunkData) \
+            LESF_IPC_MEMBERS(id, seq REFLIST(_response)) \
+        public: \
+            StreamChunkData(std::string id, unsigned seq, Response data) : \
+                id(std::move(id)), \
+                seq(seq), \
+                data(std::move(data)) \
+            {} \
+            \
+        public: \
+            std::string id; \
+            unsigned seq; /* Position in the stream, from 0 */ \
+            Response data; \
+        }; \
+        \
+        class StreamAckData : public ipc::Message \
+        { \
+            LESF_IPC_MESSAGE(StreamAckData) \
+            LESF_IPC_MEMBERS(id, count) \
+        public: \
+            StreamAckData(std::string id, unsigned count) : \
+                id(std::move(id)), \
+                count(count) \
+            {} \
+            \
+        public: \
+            std::string id; \
+            unsigned count; /* Chunks consumed so far */ \
+        }; \
+        \
+        class CancelData : public ipc::Message \
+        { \
+            LESF_IPC_MESSAGE(CancelData) \
+            LESF_IPC_MEMBERS(id) \
+        public: \
+            CancelData(std::string id) : \
+                id(std::move(id)) \
+            {} \
+            \
+        public: \
+            std::string id; \
+        }; \
+        \
+        struct ParamsColumns \
+        { \
+            COLUMNS(_params) \
+        }; \
+        \
+        struct ResponseColumns \
+        { \
+            std::vector<int> errors; /* Error code, if any */ \
+            std::vector<std::string> error_messages; \
+            COLUMNS(_response) \
+        }; \
+        \
+        class BatchActionData : public ipc::Message \
+        { \
+            LESF_IPC_MESSAGE(BatchActionData) \
+            LESF_IPC_MEMBERS(id, priority, deadline, count COLUMN_REFLIST(_params)) \
+            \
+        public: \
+            BatchActionData(std::string id, std::vector<Params>&& params, int priority = 0, int deadline = 0) : \
+                id(std::move(id)), \
+                priority(priority), \
+                deadline(deadline), \
+                count(params.size()) \
+            { \
+                for (auto& item : params) \
+                { \
+                    (void) item; /* Unused without parameters */ \
+                    COLUMN_PUSH(_params) \
+                } \
+            } \
+            \
+            /* Move the received columns to data, throws if they don't match */ \
+            void unpack() \
+            { \
+                if (!M_unpack()) \
+                    LESF_CORE_THROW(DataFormatException, "malformed batch for action " #_ns "::" #_name " (" << id << ")"); \
+                columns = ParamsColumns(); \
+            } \
+            \
+        public: \
+            std::string id; \
+            int priority; \
+            int deadline; \
+            unsigned count; \
+            ParamsColumns columns; \
+            std::vector<Params> data; /* Filled by unpack() */ \
+            \
+        private: \
+            bool M_unpack() \
+            { \
+                data.reserve(count); \
+                for (unsigned i = 0; i < count; ++i) \
+                { \
+                    Params item; \
+                    COLUMN_PULL(_params) \
+                    data.push_back(std::move(item)); \
+                } \
+                return true; \
+            } \
+        }; \
+        \
+        class BatchResponseData : public ipc::Message \
+        { \
+            LESF_IPC_MESSAGE(BatchResponseData) \
+            LESF_IPC_MEMBERS(id, count, columns.errors, columns.error_messages COLUMN_REFLIST(_response)) \
+            \
+        public: \
+            BatchResponseData(std::string id, std::vector<ResponseOrError<_name>>&& results) : \
+                id(std::move(id)), \
+                count(results.size()) \
+            { \
+                for (auto& result : results) \
+                { \
+                    /* Errors still take a (default) slot in the response columns */ \
+                    Response item{}; \
+                    if (result.isError()) \
+                    { \
+                        Error& error = result.template get<Error>(); \
+                        columns.errors.push_back(error.code ? error.code : -1); \
+                        columns.error_messages.push_back(std::move(error.message)); \
+                    } \
+                    else \
+                    { \
+                        item = std::move(result.template get<Response>()); \
+                        columns.errors.push_back(0); \
+                        columns.error_messages.push_back(std::string()); \
+                    } \
+                    COLUMN_PUSH(_response) \
+                } \
+            } \
+            \
+            /* Move the received columns to the results, throws if they don't match */ \
+            std::vector<ResponseOrError<_name>> unpack() \
+            { \
+                std::vector<ResponseOrError<_name>> results; \
+                if (!M_unpack(results)) \
+                    LESF_CORE_THROW(DataFormatException, "malformed batch response for action " #_ns "::" #_name " (" << id << ")"); \
+                return results; \
+            } \
+            \
+        public: \
+            std::string id; \
+            unsigned count; \
+            ResponseColumns columns; \
+            \
+        private: \
+            bool M_unpack(std::vector<ResponseOrError<_name>>& results) \
+            { \
+                if (columns.errors.size() != count || columns.error_messages.size() != count) \
+                    return false; \
+                results.reserve(count); \
+                for (unsigned i = 0; i < count; ++i) \
+                { \
+                    Response item{}; \
+                    COLUMN_PULL(_response) \
+                    if (columns.errors[i]) \
+                        results.push_back(ResponseOrError<_name>(Error(std::move(columns.error_messages[i]), columns.errors[i]))); \
+                    else \
+                        results.push_back(ResponseOrError<_name>(std::move(item))); \
+                } \
+                return true; \
+            } \
+        }; \
+        \
         class Internals \
         { \
         public: \
@@ -194,44 +511,176 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
             { \
                 MessageFactory::registerMessageType<ActionData>(#_ns "::" #_name "_action"); \
                 MessageFactory::registerMessageType<ResponseData>(#_ns "::" #_name "_response"); \
+                MessageFactory::registerMessageType<BatchActionData>(#_ns "::" #_name "_batch_action"); \
+                MessageFactory::registerMessageType<BatchResponseData>(#_ns "::" #_name "_batch_response"); \
+                MessageFactory::registerMessageType<StreamChunkData>(#_ns "::" #_name "_chunk"); \
+                MessageFactory::registerMessageType<StreamAckData>(#_ns "::" #_name "_stream_ack"); \
+                MessageFactory::registerMessageType<CancelData>(#_ns "::" #_name "_cancel"); \
             } \
             \
             std::set<Endpoint*> endpoints; \
             std::map<std::string, ResponseHandler> active_handlers; \
+            std::set<Endpoint*> batch_endpoints; \
+            std::map<std::string, BatchResponseHandler> active_batch_handlers; \
+            std::set<Endpoint*> stream_endpoints; \
+            std::map<std::string, std::shared_ptr<ChunkHandler>> active_streams; \
+            std::set<std::string> cancelled; /* Until their (ignored) response arrives */ \
         }; \
     \
     public: \
         _name(Params const& params) : \
-            m_params(params) \
+            m_params(params), \
+            m_priority(0), \
+            m_timeout_ms(0) \
         {} \
         \
         _name(Params&& params) : \
-            m_params(std::move(params)) \
+            m_params(std::move(params)), \
+            m_priority(0), \
+            m_timeout_ms(0) \
         {} \
         \
         ~_name() \
         {} \
         \
-        std::string async(Endpoint* ep, ResponseHandler handler) \
+        /* Start the action, handler will be called from the receiving thread */ \
+        /*   of ep with the response (or error). The parameters are moved */ \
+        /*   when called on a temporary, as in _name(params).async(...). */ \
+        std::string async(Endpoint* ep, ResponseHandler handler) const & \
+        { \
+            return M_async(ep, ActionData(ActionServer::generateId(), m_params, \
+                                          m_priority, ActionServer::deadlineIn(m_timeout_ms)), std::move(handler)); \
+        } \
+        \
+        std::string async(Endpoint* ep, ResponseHandler handler) && \
+        { \
+            return M_async(ep, ActionData(ActionServer::generateId(), std::move(m_params), \
+                                          m_priority, ActionServer::deadlineIn(m_timeout_ms)), std::move(handler)); \
+        } \
+        \
+        /* Start a streaming action (see ActionServer::registerStreamingAction()), */ \
+        /*   on_chunk will be called from the receiving thread of ep with each */ \
+        /*   partial response, in order, then handler with the final one. */ \
+        std::string stream(Endpoint* ep, ChunkHandler on_chunk, ResponseHandler handler) const & \
+        { \
+            return M_stream(ep, ActionData(ActionServer::generateId(), m_params, \
+                                           m_priority, ActionServer::deadlineIn(m_timeout_ms)), \
+                            std::move(on_chunk), std::move(handler)); \
+        } \
+        \
+        std::string stream(Endpoint* ep, ChunkHandler on_chunk, ResponseHandler handler) && \
+        { \
+            return M_stream(ep, ActionData(ActionServer::generateId(), std::move(m_params), \
+                                           m_priority, ActionServer::deadlineIn(m_timeout_ms)), \
+                            std::move(on_chunk), std::move(handler)); \
+        } \
+        \
+        /* Set the priority of the action (higher first, 0 by default) and its */ \
+        /*   timeout in milliseconds (0 for none, the default), counted from */ \
+        /*   the call to async(). These are used by the scheduler of the server */ \
+        /*   (see ipc::ActionServer), which fails actions that did not start */ \
+        /*   before their deadline. */ \
+        _name& withPriority(int priority) & \
         { \
-            std::lock_guard<std::mutex> lock(m_mutex); \
-             \
-            ActionData data(ActionServer::generateId(), m_params); \
+            m_priority = priority; \
+            return *this; \
+        } \
+        \
+        _name&& withPriority(int priority) && \
+        { \
+            m_priority = priority; \
+            return std::move(*this); \
+        } \
+        \
+        _name& withTimeout(unsigned timeout_ms) & \
+        { \
+            m_timeout_ms = timeout_ms; \
+            return *this; \
+        } \
+        \
+        _name&& withTimeout(unsigned timeout_ms) && \
+        { \
+            m_timeout_ms = timeout_ms; \
+            return std::move(*this); \
+        } \
+        \
+        /* Start a batch of actions, sent in a single message (which must fit */ \
+        /*   in ipc::Endpoint::MaxMessageSize) and handled at once by the */ \
+        /*   server. handler is called once, with the results in the order of */ \
+        /*   params, and the id of the batch. Priority and timeout apply to */ \
+        /*   the whole batch, as for single actions. */ \
+        static std::string batch(Endpoint* ep, std::vector<Params> params, BatchResponseHandler handler, \
+                                 int priority = 0, unsigned timeout_ms = 0) \
+        { \
+            BatchActionData data(ActionServer::generateId(), std::move(params), \
+                                 priority, ActionServer::deadlineIn(timeout_ms)); \
             \
-            if (m_internals.endpoints.find(ep) == m_internals.endpoints.end()) \
             { \
-                m_internals.endpoints.insert(ep); \
-                ep->registerSlot<_name::ResponseData>( \
-                    std::bind(&_name::M_responseHandler, \
-                              static_cast<_name*>(0), \
-                              std::placeholders::_1, \
-                              std::placeholders::_2)); \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                if (m_internals.batch_endpoints.find(ep) == m_internals.batch_endpoints.end()) \
+                { \
+                    m_internals.batch_endpoints.insert(ep); \
+                    ep->registerConsumingSlot<_name::BatchResponseData>(&_name::M_batchResponseHandler); \
+                } \
+                \
+                m_internals.active_batch_handlers.emplace(data.id, std::move(handler)); \
             } \
             \
-            m_internals.active_handlers[data.id] = handler; \
+            /* Sent without the lock, see M_async() */ \
             ep->send(data); \
             \
-            return data.id; \
+            return std::move(data.id); \
+        } \
+        \
+        /* Caching policy declared in the .def file, if any */ \
+        static ActionCachePolicy cachePolicy() \
+        { \
+            static_assert(!ActionCachePolicy{ __VA_OPT__(ACTION_OPTION_ ## __VA_ARGS__) }.max_entries || \
+                          !(HAS_BLOB(_params) || HAS_BLOB(_response)), \
+                          "action " #_ns "::" #_name " has blobs and can't be cached"); \
+            return ActionCachePolicy{ __VA_OPT__(ACTION_OPTION_ ## __VA_ARGS__) }; \
+        } \
+        \
+        static std::string serializeParams(Params const& params) \
+        { \
+            try { \
+                Params& __attribute__((unused)) data = const_cast<Params&>(params); \
+                \
+                json::Template tpl; \
+                BINDINGS(_params) \
+                \
+                if (!tpl.bound()) \
+                    return "{}"; \
+                std::ostringstream ss; \
+                json::Node* repr = tpl.synthetize(); \
+                repr->serialize(ss, true); \
+                delete repr; \
+                \
+                return ss.str(); \
+            } catch (std::exception const& exc) { \
+                LESF_CORE_THROW(DataFormatException, "unable to serialize parameters for action " #_ns "::" #_name); \
+            } \
+        } \
+        \
+        /* Cancel an action (or batch) started on ep, its handler will not be */ \
+        /*   called. The server is told so that it can drop the action if not */ \
+        /*   started yet, or stop it (see ActionServer::cancellation()). */ \
+        /*   Returns false if the action is unknown or already completed. */ \
+        static bool cancel(Endpoint* ep, std::string const& id) \
+        { \
+            { \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                if (!m_internals.active_handlers.erase(id) && !m_internals.active_batch_handlers.erase(id)) \
+                    return false; \
+                \
+                m_internals.active_streams.erase(id); \
+                m_internals.cancelled.insert(id); \
+            } \
+            \
+            ep->send(CancelData(id)); \
+            return true; \
         } \
         \
         static Params constructParams(std::string const& json) \
@@ -248,7 +697,7 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
                 tpl.extract(repr); \
                 delete repr; \
                 \
-                return std::move(data); \
+                return data; \
             } catch (std::exception const& exc) { \
                 LESF_CORE_THROW(DataFormatException, "unable to construct parameters from JSON data for action " #_ns "::" #_name ": " << exc.what()); \
             } \
@@ -302,31 +751,131 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
                 return serializeResponse(roe.getResponse()); \
         } \
     private: \
-        void M_responseHandler(Endpoint&, ResponseData const& resp) \
+        static std::string M_async(Endpoint* ep, ActionData&& data, ResponseHandler&& handler) \
         { \
-            std::lock_guard<std::mutex> lock(m_mutex); \
+            { \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                if (m_internals.endpoints.find(ep) == m_internals.endpoints.end()) \
+                { \
+                    m_internals.endpoints.insert(ep); \
+                    ep->registerConsumingSlot<_name::ResponseData>(&_name::M_responseHandler); \
+                } \
+                \
+                m_internals.active_handlers.emplace(data.id, std::move(handler)); \
+            } \
+            \
+            /* Don't hold the lock while sending : this can block until the */ \
+            /*   server takes the request, which may itself wait for us to */ \
+            /*   take its responses */ \
+            ep->send(data); \
             \
-            auto it = m_internals.active_handlers.find(resp.id); \
+            return std::move(data.id); \
+        } \
+        \
+        static void M_responseHandler(Endpoint&, ResponseData&& resp) \
+        { \
+            ResponseHandler handler; \
             \
-            if (it == m_internals.active_handlers.end()) \
             { \
-                LESF_CORE_THROW(BadActionId, "unknown response id in command " #_ns "::" #_name " (" << resp.id << ")"); \
-                return; \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                auto it = m_internals.active_handlers.find(resp.id); \
+                \
+                if (it == m_internals.active_handlers.end()) \
+                { \
+                    if (m_internals.cancelled.erase(resp.id)) \
+                        return; \
+                    LESF_CORE_THROW(BadActionId, "unknown response id in command " #_ns "::" #_name " (" << resp.id << ")"); \
+                } \
+                \
+                handler = std::move(it->second); \
+                m_internals.active_handlers.erase(it); \
+                m_internals.active_streams.erase(resp.id); \
             } \
             \
-            std::shared_ptr<ResponseOrError<_name>> resp_or_err; \
+            /* The handler is called without the lock, so that it can start other actions */ \
             if (resp.error.set) \
-                resp_or_err = std::make_shared<ResponseOrError<_name>>(resp.error); \
+                handler(ResponseOrError<_name>(std::move(resp.error)), resp.id); \
             else \
-                resp_or_err = std::make_shared<ResponseOrError<_name>>(resp.data); \
-            it->second(*resp_or_err, resp.id); \
-            m_internals.active_handlers.erase(it); \
+                handler(ResponseOrError<_name>(std::move(resp.data)), resp.id); \
+        } \
+        \
+        static std::string M_stream(Endpoint* ep, ActionData&& data, ChunkHandler&& on_chunk, ResponseHandler&& handler) \
+        { \
+            { \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                if (m_internals.stream_endpoints.find(ep) == m_internals.stream_endpoints.end()) \
+                { \
+                    m_internals.stream_endpoints.insert(ep); \
+                    ep->registerConsumingSlot<_name::StreamChunkData>(&_name::M_chunkHandler); \
+                } \
+                \
+                m_internals.active_streams.emplace(data.id, std::make_shared<ChunkHandler>(std::move(on_chunk))); \
+            } \
+            \
+            /* The final response is handled as for any action */ \
+            return M_async(ep, std::move(data), std::move(handler)); \
+        } \
+        \
+        static void M_chunkHandler(Endpoint& ep, StreamChunkData&& chunk) \
+        { \
+            std::shared_ptr<ChunkHandler> handler; \
+            \
+            { \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                auto it = m_internals.active_streams.find(chunk.id); \
+                \
+                if (it == m_internals.active_streams.end()) \
+                { \
+                    if (m_internals.cancelled.count(chunk.id)) \
+                        return; \
+                    LESF_CORE_THROW(BadActionId, "unknown stream id in command " #_ns "::" #_name " (" << chunk.id << ")"); \
+                } \
+                \
+                handler = it->second; \
+            } \
+            \
+            (*handler)(chunk.data, chunk.id); \
+            \
+            /* Give credits back to the server once the chunk is consumed, */ \
+            /*   posted as we are on the receiving thread (see Endpoint::post()) */ \
+            unsigned count = chunk.seq + 1; \
+            if (count % (ActionServer::StreamWindow / 2) == 0) \
+                ep.post(StreamAckData(std::move(chunk.id), count)); \
+        } \
+        \
+        static void M_batchResponseHandler(Endpoint&, BatchResponseData&& resp) \
+        { \
+            BatchResponseHandler handler; \
+            \
+            { \
+                std::lock_guard<std::mutex> lock(m_mutex); \
+                \
+                auto it = m_internals.active_batch_handlers.find(resp.id); \
+                \
+                if (it == m_internals.active_batch_handlers.end()) \
+                { \
+                    if (m_internals.cancelled.erase(resp.id)) \
+                        return; \
+                    LESF_CORE_THROW(BadActionId, "unknown batch response id in command " #_ns "::" #_name " (" << resp.id << ")"); \
+                } \
+                \
+                handler = std::move(it->second); \
+                m_internals.active_batch_handlers.erase(it); \
+            } \
+            \
+            handler(resp.unpack(), resp.id); \
         } \
     \
     private: \
         static std::mutex m_mutex; \
         static Internals m_internals; \
         Params m_params; \
+        int m_priority; \
+        unsigned m_timeout_ms; \
     }; \
 } } } }
 
@@ -350,6 +899,37 @@ namespace lesf { namespace ipc { namespace user { namespace _ns { \
 #undef BINDINGS_PARAMS
 #undef BINDINGS_RESPONSE
 #undef BINDINGS
+#undef COLUMNS_IMPL__
+#undef COLUMNS_IMPL_EACH
+#undef COLUMNS_FOREACH
+#undef COLUMNS_PARAMS
+#undef COLUMNS_RESPONSE
+#undef COLUMNS
+#undef COLUMN_REFLIST_IMPL__
+#undef COLUMN_REFLIST_IMPL_EACH
+#undef COLUMN_REFLIST_FOREACH
+#undef COLUMN_REFLIST_PARAMS
+#undef COLUMN_REFLIST_RESPONSE
+#undef COLUMN_REFLIST
+#undef COLUMN_PUSH_IMPL__
+#undef COLUMN_PUSH_IMPL_EACH
+#undef COLUMN_PUSH_FOREACH
+#undef COLUMN_PUSH_PARAMS
+#undef COLUMN_PUSH_RESPONSE
+#undef COLUMN_PUSH
+#undef COLUMN_PULL_IMPL__
+#undef COLUMN_PULL_IMPL_EACH
+#undef COLUMN_PULL_FOREACH
+#undef COLUMN_PULL_PARAMS
+#undef COLUMN_PULL_RESPONSE
+#undef COLUMN_PULL
+#undef HAS_BLOB_IMPL__
+#undef HAS_BLOB_IMPL_EACH
+#undef HAS_BLOB_FOREACH
+#undef HAS_BLOB_PARAMS
+#undef HAS_BLOB_RESPONSE
+#undef HAS_BLOB
+#undef ACTION_OPTION_CACHE
 #undef ACTION
 
 #endif // __LESF_IPC_USER_ACTIONS_H__
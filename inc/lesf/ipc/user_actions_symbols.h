@@ -7,7 +7,7 @@
 
 #include "lesf/core/preprocessor.h"
 
-#define ACTION(_ns, _name, _params, _response) \
+#define ACTION(_ns, _name, _params, _response, ...) \
     std::mutex lesf::ipc::user::_ns::_name::m_mutex; \
     lesf::ipc::user::_ns::_name::Internals lesf::ipc::user::_ns::_name::m_internals;
 
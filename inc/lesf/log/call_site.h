@@ -0,0 +1,92 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LESF_LOG_CALL_SITE_H__
+#define __LESF_LOG_CALL_SITE_H__
+
+#include "lesf/log/message.h"
+
+#include <atomic>
+#include <string>
+
+namespace lesf { namespace log {
+
+// Static description of a log statement, built once per call site by the
+//   LESF_LOG* macros. Call sites are registered the first time they are used,
+//   so that messages only need to carry their identifier : the client sends
+//   the build information of a call site once per connection.
+struct CallSite
+{
+    Message::Type type;
+    const char* format; // The stream expression for LESF_LOG*
+    const char* file;
+    int line;
+    const char* function;
+    const char* build_date;
+    const char* build_time;
+    const char* user_build_id;
+    const char* user_program;
+    const char* user_version;
+    mutable std::atomic<unsigned> registered_id; // 0 until registered
+    mutable std::atomic<int> state; // See State
+
+    enum State
+    {
+        Unregistered = 0,
+        Enabled,
+        Disabled
+    };
+
+    // Whether the statement must be logged, checked before evaluating its
+    //   arguments (thus a relaxed load, changes are seen eventually)
+    bool enabled() const
+    {
+        int current = state.load(std::memory_order_relaxed);
+        return current == Enabled || (current == Unregistered && M_register());
+    }
+
+    // Get the identifier of this call site, registering it if needed
+    unsigned id() const;
+
+    Message::BuildInfo buildInfo() const;
+
+    // Get a registered call site, or null if unknown
+    static CallSite const* find(unsigned id);
+
+    // Enable or disable the call sites of the given level or less severe,
+    //   optionally only in a file (matching the end of its path) or function.
+    // Rules apply to all call sites, including the ones not used yet, and
+    //   the last matching one wins (all call sites are enabled by default).
+    static void setEnabled(bool enabled, Message::Type level = Message::Crash,
+                           std::string const& file = "", std::string const& function = "");
+
+private:
+    // Register the call site and apply the rules, returns whether it is enabled
+    bool M_register() const;
+};
+
+} }
+
+#define LESF_LOG_CALL_SITE(name, type, format) \
+    static const lesf::log::CallSite name = \
+        { lesf::log::Message::type, format, \
+          __FILE__, __LINE__, __FUNCTION__, __DATE__, __TIME__, \
+          LESF_USER_BUILD_ID, LESF_USER_PROGRAM, LESF_USER_VERSION, { 0U }, { 0 } }
+
+#endif // __LESF_LOG_CALL_SITE_H__
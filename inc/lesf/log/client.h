@@ -20,10 +20,14 @@
 #define __LESF_LOG_CLIENT_H__
 
 #include "lesf/log/config.h"
+#include "lesf/log/message.h"
 
 #include <string>
 #include <deque>
 #include <array>
+#include <set>
+#include <map>
+#include <cstddef>
 
 namespace lesf { namespace log {
 // This class is used to connect to a LogServer at a given server & address
@@ -31,42 +35,102 @@ namespace lesf { namespace log {
 // LogClient::write() can be called even if the client is not yet connected to the
 //   server. Data will be queued until connection is gained. In case of disconnection or
 //   socket error, LogClient will attempt to regain the connection indefinitely.
+// Servers must be upgraded before their clients : the client proposes the binary
+//   protocol and sends call sites in frames that servers from before them can't
+//   make sense of (see log::Session).
 
 class Client
 {
 public:
     enum
     {
-        ConnectionRetryTimeout = 10 // ms
+        ConnectionRetryTimeout = 10, // ms
+        MaxWriteSize = 64 * 1024, // Bytes gathered in a single write, roughly
+        MaxWriteCount = 256 // Messages gathered in a single write
+    };
+
+    // What to do when the queue of messages waiting to be sent is full
+    enum QueuePolicy
+    {
+        DropOldest, // Evict the oldest queued messages
+        DropNewest, // Drop the new message
+        DropLessSevere // Drop the new message if less severe than a level, evict the oldest otherwise
     };
 
 private:
     class Internals; // Used to hide boost::asio stuff from this header
 
 public:
-    Client(unsigned short port = Config::ServerPort, std::string const& server = "localhost");
+    // If linger isn't 0, messages logged while the client is idle are sent
+    //   after up to linger milliseconds (or as soon as MaxWriteCount are
+    //   queued), to gather them in fewer writes.
+    Client(unsigned short port = Config::ServerPort, std::string const& server = "localhost",
+           unsigned linger = 0);
     ~Client();
 
     Client(Client const&) = delete;
     Client& operator=(Client const&) = delete;
 
-    void send(std::string const& msg);
+    // Send a message. It is serialized when written, using the binary protocol
+    //   if the server supports it (see log::Session, which must be at least as
+    //   recent as the client). The build info of its call site, if any, is sent
+    //   once per connection, before the first such message. Messages too big
+    //   for a frame are dropped, and reported apart from the queue overflows.
+    void send(Message const& msg);
+
+    // Bound the memory used by messages waiting to be sent (in bytes, roughly,
+    //   Config::ClientQueueSize by default with DropOldest). Dropped messages
+    //   are counted, and reported to the server with a warning when possible.
+    void setQueueLimit(std::size_t max_bytes, QueuePolicy policy = DropOldest,
+                       Message::Type level = Message::Warning);
 
 private:
     void M_ioThread(); // Thread for boost::io_context.
     void M_doConnect(); // Attempt to connect to remote server.
-    void M_doRead(); // Monitor socket status, when connected.
-    void M_queueMessage(std::string msg_with_header); // Schedule message for sending.
-    void M_doWrite(); // Attempt to write queued message
+    void M_doRead(); // Monitor socket status and get the protocol, when connected.
+    void M_queueMessage(Message const& msg); // Schedule message for sending.
+    void M_doWrite(); // Attempt to write queued messages
+    void M_doLinger(); // Wait a bit for more messages before writing
+
+    // Make room for a message of the given size, returns false if it must be dropped
+    bool M_makeRoom(Message const& msg, std::size_t size);
+    void M_dropped(Message const& msg);
+    void M_oversized(Message const& msg);
+    void M_queueDropReport(); // Queue a warning about the dropped messages, if any
+
+    // Memory used by a queued message, roughly
+    static std::size_t M_queuedSize(Message const& msg);
+
+    // Serialize a frame into the write buffer, with the current protocol
+    void M_appendFrame(char kind, std::string const& data);
 
 private:
     unsigned short m_port;
     std::string m_server;
+    unsigned m_linger;
     Internals* m_internals;
     bool m_connected;
     bool m_terminate;
-    std::deque<std::string> m_message_queue;
-    std::array<char, 1> m_dummy; // Dummy buffer used for M_doRead()
+    std::deque<Message> m_message_queue;
+    std::size_t m_queued_bytes;
+    std::size_t m_max_queued_bytes;
+    QueuePolicy m_queue_policy;
+    Message::Type m_drop_level;
+    std::map<Message::Type, std::size_t> m_dropped; // Since the last report
+    std::size_t m_oversized; // Dropped because too big for a frame, since the last report
+    Message::ProcessInfo m_dropped_process; // Of the last dropped message
+
+    // State of the current connection
+    std::set<unsigned> m_sent_call_sites;
+    bool m_hello_pending; // The binary protocol must be proposed
+    bool m_switch_pending; // The server accepted it, switch on next write
+    bool m_binary;
+
+    bool m_writing;
+    bool m_lingering;
+    std::string m_write_buffer; // Reused
+    std::size_t m_write_count; // Messages in the write buffer
+    std::array<char, 1> m_dummy; // Buffer used for M_doRead()
 };
 
 } }
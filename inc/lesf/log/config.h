@@ -28,6 +28,12 @@ namespace Config
         ServerPort = 50001U,
     };
 
+    enum : unsigned
+    {
+        AsyncBufferSize = 1024U, // Messages per thread, see Logger::startAsync()
+        ClientQueueSize = 16U * 1024U * 1024U, // Bytes, see Client::setQueueLimit()
+    };
+
     extern const char* FallbackLogFilePrefix;
 };
 
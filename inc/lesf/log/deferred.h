@@ -0,0 +1,169 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LESF_LOG_DEFERRED_H__
+#define __LESF_LOG_DEFERRED_H__
+
+#include <string>
+#include <ostream>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <new>
+
+namespace lesf { namespace log {
+
+// The raw argument values of a log statement, captured by copy and rendered
+//   into its format later (usually by the background thread of the logger).
+// Each "{}" of the format is replaced by the next argument, using its
+//   operator<<, and extra arguments are appended. C strings are copied, as
+//   they may not outlive the log statement.
+class DeferredArgs
+{
+public:
+    // Arguments up to this size are stored inline, larger ones are allocated
+    static const std::size_t InlineSize = 64UL;
+
+public:
+    template <std::size_t N, typename... Args>
+    static DeferredArgs capture(const char (&)[N], Args&&... args)
+    {
+        return DeferredArgs(Tag<Tuple<Args...>>(), std::forward<Args>(args)...);
+    }
+
+    DeferredArgs(DeferredArgs&& other);
+    ~DeferredArgs();
+
+    DeferredArgs(DeferredArgs const&) = delete;
+    DeferredArgs& operator=(DeferredArgs const&) = delete;
+
+    std::string render(const char* format) const;
+
+private:
+    template <typename T> struct Tag {};
+
+    // C strings are stored as std::string, everything else by value
+    template <typename T>
+    struct Stored
+    {
+        typedef typename std::decay<T>::type decayed;
+        typedef typename std::conditional<
+            std::is_same<decayed, char*>::value || std::is_same<decayed, const char*>::value,
+            std::string, decayed>::type type;
+    };
+
+    template <typename... Args>
+    using Tuple = std::tuple<typename Stored<Args>::type...>;
+
+    // Manage a T in the storage, inline or allocated
+    template <typename T, bool Inline = (sizeof(T) <= InlineSize && alignof(T) <= alignof(std::max_align_t) &&
+                                         std::is_nothrow_move_constructible<T>::value)>
+    struct Holder
+    {
+        template <typename... Args>
+        static void create(void* storage, Args&&... args) { new (storage) T(std::forward<Args>(args)...); }
+        static T const& get(void const* storage) { return *reinterpret_cast<T const*>(storage); }
+        static void move(void* to, void* from) { new (to) T(std::move(*reinterpret_cast<T*>(from))); }
+        static void destroy(void* storage) { reinterpret_cast<T*>(storage)->~T(); }
+    };
+
+    template <typename T>
+    struct Holder<T, false>
+    {
+        template <typename... Args>
+        static void create(void* storage, Args&&... args) { *reinterpret_cast<T**>(storage) = new T(std::forward<Args>(args)...); }
+        static T const& get(void const* storage) { return **reinterpret_cast<T* const*>(storage); }
+        static void move(void* to, void* from)
+        {
+            *reinterpret_cast<T**>(to) = *reinterpret_cast<T**>(from);
+            *reinterpret_cast<T**>(from) = 0;
+        }
+        static void destroy(void* storage) { delete *reinterpret_cast<T**>(storage); }
+    };
+
+    struct Ops
+    {
+        void (*render)(std::ostream&, const char*, void const*);
+        void (*move)(void*, void*);
+        void (*destroy)(void*);
+    };
+
+    template <typename T, typename... Args>
+    DeferredArgs(Tag<T>, Args&&... args) :
+        m_ops(&M_ops<T>())
+    {
+        Holder<T>::create(&m_storage, std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    static Ops const& M_ops()
+    {
+        static const Ops ops =
+        {
+            [](std::ostream& os, const char* format, void const* storage)
+            {
+                M_render<0>(os, format, Holder<T>::get(storage), std::integral_constant<bool, (std::tuple_size<T>::value > 0)>());
+            },
+            &Holder<T>::move,
+            &Holder<T>::destroy
+        };
+
+        return ops;
+    }
+
+    template <std::size_t I, typename T>
+    static void M_render(std::ostream& os, const char* format, T const& args, std::true_type)
+    {
+        format = M_renderLiteral(os, format);
+        if (*format)
+            format += 2;
+        else
+            os << ' ';
+
+        os << std::get<I>(args);
+        M_render<I + 1>(os, format, args, std::integral_constant<bool, (I + 1 < std::tuple_size<T>::value)>());
+    }
+
+    template <std::size_t I, typename T>
+    static void M_render(std::ostream& os, const char* format, T const&, std::false_type)
+    {
+        // Placeholders without arguments are kept as is
+        while (*format)
+        {
+            format = M_renderLiteral(os, format);
+            if (*format)
+            {
+                os << "{}";
+                format += 2;
+            }
+        }
+    }
+
+    // Write the format up to the next placeholder, returns its position (or the end)
+    static const char* M_renderLiteral(std::ostream& os, const char* format);
+
+private:
+    Ops const* m_ops; // Null once moved from
+    typename std::aligned_storage<InlineSize, alignof(std::max_align_t)>::type m_storage;
+};
+
+} }
+
+#endif // __LESF_LOG_DEFERRED_H__
@@ -21,6 +21,8 @@
 
 #include "config.h"
 #include "message.h"
+#include "call_site.h"
+#include "deferred.h"
 #include "server.h"
 #include "client.h"
 #include "logger.h"
@@ -23,48 +23,135 @@
 #include "lesf/log/config.h"
 #include "lesf/log/message.h"
 #include "lesf/log/client.h"
+#include "lesf/log/call_site.h"
+#include "lesf/log/deferred.h"
+#include "lesf/core/preprocessor.h"
 
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <chrono>
 
-#define LESF_LOG_TRACE(fmt)   LESF_LOG(Trace, fmt)
-#define LESF_LOG_INFO(fmt)    LESF_LOG(Info, fmt)
-#define LESF_LOG_WARNING(fmt) LESF_LOG(Warning, fmt)
-#define LESF_LOG_ERROR(fmt)   LESF_LOG(Error, fmt)
-#define LESF_LOG_CRASH(fmt)   LESF_LOG(Crash, fmt)
+// Levels, as in log::Message::Type
+#define LESF_LOG_LEVEL_CRASH   -1
+#define LESF_LOG_LEVEL_ERROR   0
+#define LESF_LOG_LEVEL_WARNING 1
+#define LESF_LOG_LEVEL_INFO    2
+#define LESF_LOG_LEVEL_TRACE   3
 
-#define LESF_LOG_TRACE_WITH_EXCEPT(exc, fmt)   LESF_LOG_WITH_EXCEPT(Trace, exc, fmt)
-#define LESF_LOG_INFO_WITH_EXCEPT(exc, fmt)    LESF_LOG_WITH_EXCEPT(Info, exc, fmt)
-#define LESF_LOG_WARNING_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Warning, exc, fmt)
-#define LESF_LOG_ERROR_WITH_EXCEPT(exc, fmt)   LESF_LOG_WITH_EXCEPT(Error, exc, fmt)
-#define LESF_LOG_CRASH_WITH_EXCEPT(exc, fmt)   LESF_LOG_WITH_EXCEPT(Crash, exc, fmt)
+// Log statements less severe than this level are compiled out, without
+//   evaluating their arguments (crashes are always logged).
+//   e.g. -DLESF_LOG_MIN_LEVEL=LESF_LOG_LEVEL_INFO to remove traces
+#ifndef LESF_LOG_MIN_LEVEL
+# define LESF_LOG_MIN_LEVEL LESF_LOG_LEVEL_TRACE
+#endif
 
+#if LESF_LOG_MIN_LEVEL >= LESF_LOG_LEVEL_TRACE
+# define LESF_LOG_TRACE(fmt)                  LESF_LOG(Trace, fmt)
+# define LESF_LOG_TRACE_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Trace, exc, fmt)
+# define LESF_LOGF_TRACE(...)                 LESF_LOGF(Trace, __VA_ARGS__)
+#else
+# define LESF_LOG_TRACE(fmt)                  LESF_LOG_DISABLED(fmt)
+# define LESF_LOG_TRACE_WITH_EXCEPT(exc, fmt) LESF_LOG_DISABLED_WITH_EXCEPT(exc, fmt)
+# define LESF_LOGF_TRACE(...)                 LESF_LOGF_DISABLED(__VA_ARGS__)
+#endif
+
+#if LESF_LOG_MIN_LEVEL >= LESF_LOG_LEVEL_INFO
+# define LESF_LOG_INFO(fmt)                  LESF_LOG(Info, fmt)
+# define LESF_LOG_INFO_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Info, exc, fmt)
+# define LESF_LOGF_INFO(...)                 LESF_LOGF(Info, __VA_ARGS__)
+#else
+# define LESF_LOG_INFO(fmt)                  LESF_LOG_DISABLED(fmt)
+# define LESF_LOG_INFO_WITH_EXCEPT(exc, fmt) LESF_LOG_DISABLED_WITH_EXCEPT(exc, fmt)
+# define LESF_LOGF_INFO(...)                 LESF_LOGF_DISABLED(__VA_ARGS__)
+#endif
+
+#if LESF_LOG_MIN_LEVEL >= LESF_LOG_LEVEL_WARNING
+# define LESF_LOG_WARNING(fmt)                  LESF_LOG(Warning, fmt)
+# define LESF_LOG_WARNING_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Warning, exc, fmt)
+# define LESF_LOGF_WARNING(...)                 LESF_LOGF(Warning, __VA_ARGS__)
+#else
+# define LESF_LOG_WARNING(fmt)                  LESF_LOG_DISABLED(fmt)
+# define LESF_LOG_WARNING_WITH_EXCEPT(exc, fmt) LESF_LOG_DISABLED_WITH_EXCEPT(exc, fmt)
+# define LESF_LOGF_WARNING(...)                 LESF_LOGF_DISABLED(__VA_ARGS__)
+#endif
+
+#if LESF_LOG_MIN_LEVEL >= LESF_LOG_LEVEL_ERROR
+# define LESF_LOG_ERROR(fmt)                  LESF_LOG(Error, fmt)
+# define LESF_LOG_ERROR_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Error, exc, fmt)
+# define LESF_LOGF_ERROR(...)                 LESF_LOGF(Error, __VA_ARGS__)
+#else
+# define LESF_LOG_ERROR(fmt)                  LESF_LOG_DISABLED(fmt)
+# define LESF_LOG_ERROR_WITH_EXCEPT(exc, fmt) LESF_LOG_DISABLED_WITH_EXCEPT(exc, fmt)
+# define LESF_LOGF_ERROR(...)                 LESF_LOGF_DISABLED(__VA_ARGS__)
+#endif
+
+#define LESF_LOG_CRASH(fmt)                  LESF_LOG(Crash, fmt)
+#define LESF_LOG_CRASH_WITH_EXCEPT(exc, fmt) LESF_LOG_WITH_EXCEPT(Crash, exc, fmt)
+#define LESF_LOGF_CRASH(...)                 LESF_LOGF(Crash, __VA_ARGS__)
+
+// Compiled out statements, still "using" their arguments in an unevaluated
+//   context so that they don't trigger unused variable warnings
+#define LESF_LOG_DISABLED(fmt) \
+    do { (void) sizeof(lesf::log::Logger::InfoStringBuilder() << fmt); } while (0)
+
+#define LESF_LOG_DISABLED_WITH_EXCEPT(exc, fmt) \
+    do { (void) sizeof(exc); (void) sizeof(lesf::log::Logger::InfoStringBuilder() << fmt); } while (0)
+
+#define LESF_LOGF_DISABLED(...) \
+    do { (void) sizeof(lesf::log::DeferredArgs::capture(__VA_ARGS__)); } while (0)
+
+// The arguments of a statement are only evaluated if its call site is
+//   enabled, see CallSite::setEnabled()
 #define LESF_LOG(type, fmt) \
-    try { \
-        lesf::log::Logger::log(lesf::log::Message( \
-            lesf::log::Message::type, \
-            { __FILE__, __LINE__, __FUNCTION__, __DATE__, __TIME__, \
-              LESF_USER_BUILD_ID, LESF_USER_PROGRAM, LESF_USER_VERSION }, \
-            lesf::log::Logger::getProcessInfo(), \
-            (lesf::log::Logger::InfoStringBuilder() << fmt))); \
-    } catch (std::exception const& e) { \
-        lesf::log::Logger::log(e, #type, #fmt); \
-    }
+    do { \
+        LESF_LOG_CALL_SITE(lesf_log_call_site, type, #fmt); \
+        if (lesf_log_call_site.enabled()) { \
+            try { \
+                lesf::log::Logger::log(lesf::log::Message( \
+                    lesf_log_call_site, \
+                    lesf::log::Logger::getProcessInfo(), \
+                    (lesf::log::Logger::InfoStringBuilder() << fmt))); \
+            } catch (std::exception const& e) { \
+                lesf::log::Logger::log(e, #type, #fmt); \
+            } \
+        } \
+    } while (0)
 
 #define LESF_LOG_WITH_EXCEPT(type, exc, fmt) \
-    try { \
-        lesf::log::Logger::log(lesf::log::Message( \
-            lesf::log::Message::type, \
-            { __FILE__, __LINE__, __FUNCTION__, __DATE__, __TIME__, \
-              LESF_USER_BUILD_ID, LESF_USER_PROGRAM, LESF_USER_VERSION }, \
-            lesf::log::Logger::getProcessInfo(), \
-            (lesf::log::Logger::InfoStringBuilder() << fmt), \
-            (exc))); \
-    } catch (std::exception const& e) { \
-        lesf::log::Logger::log(e, #type, #fmt); \
-    }
+    do { \
+        LESF_LOG_CALL_SITE(lesf_log_call_site, type, #fmt); \
+        if (lesf_log_call_site.enabled()) { \
+            try { \
+                lesf::log::Logger::log(lesf::log::Message( \
+                    lesf_log_call_site, \
+                    lesf::log::Logger::getProcessInfo(), \
+                    (lesf::log::Logger::InfoStringBuilder() << fmt), \
+                    (exc))); \
+            } catch (std::exception const& e) { \
+                lesf::log::Logger::log(e, #type, #fmt); \
+            } \
+        } \
+    } while (0)
+
+// Same as LESF_LOG, but only copies the arguments : the message is formatted
+//   later, usually by the background thread of the asynchronous logger.
+//   The format must be a string literal, see log::DeferredArgs.
+//   e.g. LESF_LOGF_TRACE("received {} bytes from {}", size, peer)
+#define LESF_LOGF(type, ...) \
+    do { \
+        LESF_LOG_CALL_SITE(lesf_log_call_site, type, LESF_CORE_PREPROCESSOR_FIRST(__VA_ARGS__, ~)); \
+        if (lesf_log_call_site.enabled()) { \
+            try { \
+                lesf::log::Logger::log(lesf_log_call_site, lesf::log::DeferredArgs::capture(__VA_ARGS__)); \
+            } catch (std::exception const& e) { \
+                lesf::log::Logger::log(e, #type, lesf_log_call_site.format); \
+            } \
+        } \
+    } while (0)
 
 namespace lesf { namespace log {
 
@@ -73,6 +160,17 @@ class Logger
 public:
     class AutoDeleter;
 
+    // What to do when a thread logs asynchronously while its buffer is full
+    enum OverflowPolicy
+    {
+        Block, // Wait for the background thread to make room
+        Drop, // Discard the message
+        CountAndDrop // Discard the message, and log how many were discarded
+    };
+
+private:
+    class Async; // Per-thread buffers and background thread, see logger.cpp
+
 public:
     class InfoStringBuilder
     {
@@ -102,13 +200,37 @@ public:
     // This function is specified as noexcept and handles exceptions when creating
     //  the internal log::Client for remote logging, but if we fail to create
     //  the logger instance log::Logger::m_inst, the program will terminate.
+    //
+    // See log::Client for the linger time (in milliseconds).
     static void init(int argc, char** argv, unsigned short port = Config::ServerPort,
-                     const char* fallback_log_file_prefix = Config::FallbackLogFilePrefix) noexcept;
+                     const char* fallback_log_file_prefix = Config::FallbackLogFilePrefix,
+                     unsigned linger = 0) noexcept;
 
     // Log a message. If the remote client could be created, send it over here.
     // If there's any problem, try to log the message in the fallback file, otherwise
     //   terminate the program.
     static void log(Message const& msg) noexcept;
+    static void log(Message&& msg) noexcept;
+
+    // Log a statement of a call site (see LESF_LOGF), formatted right away
+    //   unless logging asynchronously.
+    static void log(CallSite const& site, DeferredArgs&& args) noexcept;
+
+    // Switch to asynchronous logging : messages are queued (without locking)
+    //   in a buffer of the logging thread holding up to capacity messages
+    //   (rounded up to a power of two), and serialized and sent by a background
+    //   thread. Crash messages are still sent before log() returns, and wait
+    //   for room in a full buffer whatever the policy.
+    // When restarted with another capacity, each thread switches to a new
+    //   buffer the next time it logs.
+    static void startAsync(std::size_t capacity = Config::AsyncBufferSize, OverflowPolicy policy = Block) noexcept;
+
+    // Send the queued messages and switch back to synchronous logging.
+    static void stopAsync() noexcept;
+
+    // Bound the messages waiting to be sent to the server, see Client::setQueueLimit()
+    static void setQueueLimit(std::size_t max_bytes, Client::QueuePolicy policy = Client::DropOldest,
+                              Message::Type level = Message::Warning) noexcept;
 
     // (fallback solution when an exception is encountered in LESF_LOG_*)
     // Attempt to write information to the fallback file, terminate the program
@@ -123,9 +245,19 @@ private:
 
     static void M_maybeInstanciate();
 
+    // Queue a message if logging asynchronously, returns false otherwise
+    static bool M_queue(Message&& msg) noexcept;
+    static bool M_queue(CallSite const& site, DeferredArgs&& args,
+                        std::chrono::system_clock::time_point const& time) noexcept;
+
+    // Send a message from the calling thread
+    static void M_send(Message const& msg) noexcept;
+
 private:
     static std::mutex m_mutex;
     static Logger* m_inst;
+    static std::atomic<bool> m_async_enabled;
+    static Async* m_async; // Kept once created, see stopAsync()
 
     unsigned short m_remote_port;
     int m_argc;
@@ -22,6 +22,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <map>
 #include <chrono>
 #include <chrono>
 
@@ -33,6 +34,8 @@ namespace lesf { namespace log {
 
 using namespace lconf;
 
+struct CallSite; // See lesf/log/call_site.h
+
 class Message
 {
 public:
@@ -86,16 +89,32 @@ public:
 
     typedef std::shared_ptr<ExceptionInfo> ExceptionInfoPtr;
 
+    // Build information of the call sites known to a log server session
+    typedef std::map<unsigned, BuildInfo> CallSites;
+
 public:
     Message(Type type, BuildInfo&& build_info, ProcessInfo&& process_info, 
             std::string const& message);
     Message(Type type, BuildInfo&& build_info, ProcessInfo&& process_info,
             std::string const& message, core::Exception const& exception);
+    Message(CallSite const& site, ProcessInfo&& process_info, std::string const& message);
+    Message(CallSite const& site, ProcessInfo&& process_info, std::string const& message,
+            core::Exception const& exception);
+    Message(CallSite const& site, ProcessInfo&& process_info, std::string const& message,
+            std::chrono::system_clock::time_point const& time);
+    Message(Message const&) = default;
+    Message(Message&&) = default;
     ~Message();
 
+    Message& operator=(Message const&) = default;
+    Message& operator=(Message&&) = default;
+
     Type type() const;
     
-    BuildInfo const& buildInfo() const;
+    // Identifier of the call site of the message, or 0 if none
+    unsigned callSite() const;
+    // Built from the call site on demand, messages don't copy it
+    BuildInfo buildInfo() const;
     ProcessInfo const& processInfo() const;
     std::string const& message() const;
     std::chrono::system_clock::time_point const& time() const;
@@ -104,15 +123,40 @@ public:
     static std::string serialize(Message const& msg) noexcept;
     static Message synthetize(std::string const& serialized) noexcept;
 
+    // Serialize a message without its build info if it has a call site, which
+    //   must then be sent beforehand (see serializeCallSite()).
+    static std::string serializeCompact(Message const& msg) noexcept;
+
+    // Same as synthetize(), the build info of compact messages is looked up
+    //   in the given call sites.
+    static Message synthetize(std::string const& serialized, CallSites const& call_sites) noexcept;
+
+    // Serialize a call site, or add it to call sites (returns false if invalid)
+    static std::string serializeCallSite(CallSite const& site) noexcept;
+    static bool synthetizeCallSite(std::string const& serialized, CallSites& call_sites) noexcept;
+
+    // Same as serializeCompact() and the above, with a compact binary encoding
+    //   instead of JSON (see log::Session for the protocol negotiation)
+    static std::string serializeBinary(Message const& msg) noexcept;
+    static Message synthetizeBinary(std::string const& serialized, CallSites const& call_sites) noexcept;
+    static std::string serializeCallSiteBinary(CallSite const& site) noexcept;
+    static bool synthetizeCallSiteBinary(std::string const& serialized, CallSites& call_sites) noexcept;
+
 private:
+    void M_setExceptionInfo(core::Exception const& exception);
+
+    static std::string M_serialize(Message const& msg, bool with_build_info) noexcept;
+
     json::Template M_jsonTemplate();
-    json::Template M_buildInfoJsonTemplate();
+    static json::Template M_buildInfoJsonTemplate(BuildInfo& build_info);
     json::Template M_processInfoJsonTemplate();
     json::Template M_exceptionInfoJsonTemplate();
 
 private:
     Type m_type;
-    BuildInfo m_build_info;
+    unsigned m_call_site;
+    CallSite const* m_site; // Null unless logged from a call site of this process
+    BuildInfo m_build_info; // Empty if m_site is set
     ProcessInfo m_process_info;
     std::chrono::system_clock::time_point m_time;
     std::string m_message;
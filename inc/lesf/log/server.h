@@ -65,7 +65,7 @@ private:
     void M_ioThread();
     void M_doAccept();
 
-    void M_notifyMessageReceived(std::string const& data);
+    void M_notifyMessageReceived(Message const& msg);
 
 private:
     Internals* m_internals;
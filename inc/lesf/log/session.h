@@ -19,6 +19,8 @@
 #ifndef __LESF_LOG_SESSION_H__
 #define __LESF_LOG_SESSION_H__
 
+#include "lesf/log/message.h"
+
 #include <memory>
 #include <vector>
 #include <array>
@@ -40,9 +42,33 @@ protected:
     class Internals;  // Used to hide boost::asio stuff from this header
 
 public:
+    // Frames start with a header of HeaderSize characters : the decimal size
+    //   of the frame data for messages, or their kind followed by it otherwise,
+    //   and hold JSON data.
+    // A client supporting the binary protocol sends a HelloFrame holding its
+    //   ProtocolVersion first. If the session supports it, it answers with the
+    //   same version (a single byte), and the client switches to binary frames
+    //   after a BinaryFrame : a little endian 32 bits data size, the kind on
+    //   a byte, then binary data (see Message::serializeBinary()).
+    // Sessions still accept clients that only send message frames, but
+    //   servers from before the other frame kinds can't make sense of them :
+    //   servers must be upgraded before their clients.
+    // Frames bigger than MaxFrameSize (which fits in a header with a kind),
+    //   or with an invalid header, close the session.
     enum
     {
-        HeaderSize = 8UL
+        HeaderSize = 8UL,
+        BinaryHeaderSize = 5UL,
+        MaxFrameSize = 8UL * 1024UL * 1024UL,
+        ProtocolVersion = 1
+    };
+
+    enum FrameKind : char
+    {
+        MessageFrame = 0,
+        CallSiteFrame = 'S', // See Message::serializeCallSite()
+        HelloFrame = 'H',
+        BinaryFrame = 'B'
     };
 
 public:
@@ -57,11 +83,17 @@ public:
 private:
     void M_doReadHeader(); // Wait until message header (size) is received
     void M_doReadMessage(); // Wait until message data is received
+    void M_doAnswerHello(); // Accept (or refuse) the binary protocol
+    void M_close(); // Drop the session, on errors or invalid frames
 
 private:
     Internals* m_internals;
     std::array<char, HeaderSize> m_header;
+    bool m_binary; // Binary frames since the client switched
+    char m_answer; // See M_doAnswerHello()
+    FrameKind m_kind;
     std::vector<char> m_message;
+    Message::CallSites m_call_sites; // Sent by the client during this session
 };
 
 } }
@@ -18,23 +18,513 @@
 
 #include "lesf/ipc/action_server.h"
 
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/algorithm/hex.hpp>
 
 using namespace lesf::ipc;
 
-ActionServer::ActionServer(Endpoint& ep) :
-    m_ep(ep)
-{}
+// An action waiting for a worker thread
+struct ScheduledAction
+{
+    int priority;
+    int deadline; // 0 if none
+    std::uint64_t seq; // Arrival order
+    std::function<void()> run;
+    std::function<void(int, std::string const&)> reject;
+};
+
+// Orders actions by priority (highest first), then deadline (earliest first,
+//   actions without deadline last), then arrival. std::priority_queue pops the
+//   greatest element, hence the reversed comparisons.
+struct ScheduledActionOrder
+{
+    bool operator()(ScheduledAction const& a, ScheduledAction const& b) const
+    {
+        if (a.priority != b.priority)
+            return a.priority < b.priority;
+
+        if (a.deadline != b.deadline)
+        {
+            if (!a.deadline || !b.deadline)
+                return !a.deadline;
+            return static_cast<std::int32_t>(static_cast<std::uint32_t>(a.deadline) - static_cast<std::uint32_t>(b.deadline)) > 0;
+        }
+
+        return a.seq > b.seq;
+    }
+};
+
+struct ActionServer::Scheduler
+{
+    std::mutex mutex; // Protect everything below
+    std::condition_variable cond; // Notified when an action is queued or when stopping
+    std::priority_queue<ScheduledAction, std::vector<ScheduledAction>, ScheduledActionOrder> queue;
+    std::uint64_t seq;
+    bool stop;
+
+    std::vector<std::thread> threads;
+};
+
+ActionServer::ActionServer(Endpoint& ep, unsigned workers) :
+    m_ep(ep),
+    m_scheduler(0),
+    m_workers(workers),
+    m_outstanding(0),
+    m_max_outstanding(0),
+    m_stalled(0),
+    m_threads(0),
+    m_total_stats()
+{
+    // Leave the requests beyond the maximum number of outstanding actions to
+    //   the other receivers of the endpoint, or to the client (see setMaxOutstanding())
+    m_ep.setReceiveGate([this]()
+    {
+        std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+        return !m_max_outstanding || m_outstanding - m_stalled < m_max_outstanding;
+    });
+
+    if (!workers)
+        return;
+
+    m_scheduler = new Scheduler();
+    m_scheduler->seq = 0;
+    m_scheduler->stop = false;
+
+    for (unsigned i = 0; i < workers; ++i)
+    {
+        m_scheduler->threads.push_back(std::thread([this]()
+        {
+            for (;;)
+            {
+                ScheduledAction action;
+
+                {
+                    std::unique_lock<std::mutex> lock(m_scheduler->mutex);
+                    m_scheduler->cond.wait(lock, [this]() { return m_scheduler->stop || !m_scheduler->queue.empty(); });
+
+                    if (m_scheduler->stop)
+                        break;
+
+                    // top() is const only to protect the ordering, which pop() does not need anymore
+                    action = std::move(const_cast<ScheduledAction&>(m_scheduler->queue.top()));
+                    m_scheduler->queue.pop();
+                }
+
+                // The deadline is checked again by run()
+                action.run();
+            }
+        }));
+    }
+}
 
 ActionServer::~ActionServer()
-{}
+{
+    // No action can be received once this returns, nor cancelled, nor can
+    //   the client acknowledge stream chunks anymore
+    m_ep.setReceiveGate(nullptr);
+
+    for (auto& unregister : m_slots)
+        unregister();
+
+    // So don't let the running actions wait for it
+    std::vector<std::string> running;
+
+    {
+        std::lock_guard<std::mutex> lock(m_cancel_mutex);
+        for (auto const& cancel : m_cancels)
+            running.push_back(cancel.first);
+    }
+
+    for (auto const& id : running)
+        M_cancel(id);
+
+    {
+        std::unique_lock<std::mutex> lock(m_outstanding_mutex);
+        m_threads_cond.wait(lock, [this]() { return !m_threads; });
+    }
+
+    if (!m_scheduler)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler->mutex);
+        m_scheduler->stop = true;
+        m_scheduler->cond.notify_all();
+    }
+
+    for (auto& thread : m_scheduler->threads)
+        thread.join();
+
+    // Don't leave clients waiting for the actions that never started (which
+    //   may queue the requests waiting for them, see M_promoteWaiter())
+    while (!m_scheduler->queue.empty())
+    {
+        ScheduledAction action = std::move(const_cast<ScheduledAction&>(m_scheduler->queue.top()));
+        m_scheduler->queue.pop();
+        action.reject(ActionDropped, "action server stopped before the action started");
+    }
+
+    delete m_scheduler;
+}
+
+void ActionServer::M_schedule(int priority, int deadline, std::function<void()> run,
+                              std::function<void(int, std::string const&)> reject)
+{
+    std::lock_guard<std::mutex> lock(m_scheduler->mutex);
+    m_scheduler->queue.push(ScheduledAction{ priority, deadline, m_scheduler->seq++, std::move(run), std::move(reject) });
+    m_scheduler->cond.notify_one();
+}
+
+const char* const ActionServer::M_overloadedMessage = "action server overloaded";
+const char* const ActionServer::M_expiredMessage = "action deadline expired before it started";
+const char* const ActionServer::M_cancelledMessage = "action cancelled before it started";
+const char* const ActionServer::M_unavailableMessage = "streaming actions are not available on endpoints with workers";
+
+// The monotonic clock is shared by all processes of the host, on Linux
+static std::uint32_t monotonicMs()
+{
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch());
+    return static_cast<std::uint32_t>(now.count());
+}
+
+int ActionServer::deadlineIn(unsigned timeout_ms)
+{
+    if (!timeout_ms)
+        return 0;
+
+    // 0 means no deadline, skip it
+    std::uint32_t deadline = monotonicMs() + timeout_ms;
+    return static_cast<int>(deadline ? deadline : 1);
+}
+
+bool ActionServer::M_expired(int deadline)
+{
+    if (!deadline)
+        return false;
+
+    return static_cast<std::int32_t>(monotonicMs() - static_cast<std::uint32_t>(deadline)) > 0;
+}
+
+void ActionServer::setMaxOutstanding(unsigned max)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+        m_max_outstanding = max;
+    }
+
+    m_ep.notifyReceiveGate();
+}
+
+void ActionServer::M_releaseOutstanding()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+        --m_outstanding;
+    }
+
+    m_ep.notifyReceiveGate();
+}
+
+void ActionServer::M_stall(bool stalled)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+        stalled ? ++m_stalled : --m_stalled;
+    }
+
+    // A stalled stream must not keep its acknowledgements from being received
+    if (stalled)
+        m_ep.notifyReceiveGate();
+}
+
+void ActionServer::M_threadStarted()
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    ++m_threads;
+}
+
+void ActionServer::M_threadDone()
+{
+    // Notified under the lock, as the destructor may proceed right after
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    --m_threads;
+    m_threads_cond.notify_all();
+}
+
+void ActionServer::setLimits(Limits const& limits)
+{
+    M_setLimits(&m_total_stats, limits);
+}
+
+ActionServer::Stats ActionServer::stats() const
+{
+    return M_stats(&m_total_stats);
+}
+
+ActionServer::ActionStats* ActionServer::M_actionStats(std::string const& id)
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    // Nodes of a std::map are never moved, so the pointer stays valid
+    return &m_action_stats.emplace(id, ActionStats()).first->second;
+}
+
+void ActionServer::M_setLimits(ActionStats* stats, Limits const& limits)
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    stats->limits = limits;
+}
+
+// Actions are run right away without worker threads
+static double estimatedDelay(ActionServer::Stats const& total, unsigned workers)
+{
+    return workers ? total.queued * total.avg_run_ms / workers : 0.0;
+}
+
+ActionServer::Stats ActionServer::M_stats(ActionStats const* stats) const
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    Stats result = stats->stats;
+    result.estimated_delay_ms = estimatedDelay(m_total_stats.stats, m_workers);
+    return result;
+}
+
+// Check the limits of an action type (or all of them) against the counters
+static bool withinLimits(ActionServer::Limits const& limits, ActionServer::Stats const& stats,
+                         bool queued, double delay_ms)
+{
+    if (queued && limits.max_queued && stats.queued >= limits.max_queued)
+        return false;
+    if (!queued && limits.max_in_flight && stats.in_flight >= limits.max_in_flight)
+        return false;
+    if (queued && limits.max_delay_ms && delay_ms >= limits.max_delay_ms)
+        return false;
+
+    return true;
+}
+
+bool ActionServer::M_admit(ActionStats* stats, Stage stage)
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+    double delay_ms = estimatedDelay(m_total_stats.stats, m_workers);
+
+    if (!withinLimits(m_total_stats.limits, m_total_stats.stats, stage == Queued, delay_ms) ||
+        !withinLimits(stats->limits, stats->stats, stage == Queued, delay_ms))
+    {
+        ++m_total_stats.stats.rejected;
+        ++stats->stats.rejected;
+        return false;
+    }
+
+    for (ActionStats* s : { &m_total_stats, stats })
+    {
+        ++s->stats.accepted;
+        ++(stage == Queued ? s->stats.queued : s->stats.in_flight);
+    }
+
+    ++m_outstanding;
+    return true;
+}
+
+void ActionServer::M_start(ActionStats* stats)
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+
+    for (ActionStats* s : { &m_total_stats, stats })
+    {
+        --s->stats.queued;
+        ++s->stats.in_flight;
+    }
+}
+
+void ActionServer::M_cached(ActionStats* stats, bool hit)
+{
+    std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+
+    for (ActionStats* s : { &m_total_stats, stats })
+        ++(hit ? s->stats.cache_hits : s->stats.coalesced);
+}
+
+void ActionServer::M_finish(ActionStats* stats, Stage stage, Outcome outcome,
+                            std::chrono::steady_clock::duration run_time)
+{
+    double run_ms = std::chrono::duration<double, std::milli>(run_time).count();
+
+    {
+        std::lock_guard<std::mutex> lock(m_outstanding_mutex);
+
+        for (ActionStats* s : { &m_total_stats, stats })
+        {
+            --(stage == Queued ? s->stats.queued : s->stats.in_flight);
+
+            if (outcome == Expired)
+                ++s->stats.expired;
+            else if (outcome == Cancelled)
+                ++s->stats.cancelled;
+            else if (outcome == Completed)
+                ++s->stats.completed;
+
+            // Exponentially weighted, to follow changes in the load
+            if (run_ms > 0.0)
+                s->stats.avg_run_ms = s->stats.avg_run_ms ? 0.9 * s->stats.avg_run_ms + 0.1 * run_ms : run_ms;
+        }
+    }
+
+    M_releaseOutstanding();
+}
+
+bool detail::StreamState::waitCredit(unsigned sent)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto credit = [this, sent]() { return cancelled || sent - acked < ActionServer::StreamWindow; };
+
+    if (credit())
+        return !cancelled;
+
+    // The server lock is not taken with ours, ack() must not wait for it
+    lock.unlock();
+    server.M_stall(true);
+    lock.lock();
+
+    // Each acknowledgement gives the client another timeout
+    bool acked_in_time = true;
+    while (acked_in_time && !credit())
+    {
+        unsigned last_acked = acked;
+        acked_in_time = cond.wait_for(lock, std::chrono::milliseconds(long(ActionServer::StreamAckTimeoutMs)),
+                                      [this, last_acked]() { return cancelled || acked != last_acked; });
+    }
+
+    lock.unlock();
+    server.M_stall(false);
+    lock.lock();
+
+    return acked_in_time && !cancelled;
+}
+
+void detail::StreamState::cancel()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    cond.notify_all();
+}
+
+std::shared_ptr<detail::StreamState> detail::StreamTable::open(std::string const& id, ActionServer& server)
+{
+    auto state = std::make_shared<StreamState>(server);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_streams[id] = state;
+    return state;
+}
+
+void detail::StreamTable::close(std::string const& id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_streams.erase(id);
+}
+
+void detail::StreamTable::ack(std::string const& id, unsigned count)
+{
+    std::shared_ptr<StreamState> state;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Acknowledgements of finished streams are late, ignore them
+        auto it = m_streams.find(id);
+        if (it == m_streams.end())
+            return;
+        state = it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (count > state->acked)
+        state->acked = count;
+    state->cond.notify_all();
+}
+
+void CancellationToken::onCancel(std::function<void()> callback)
+{
+    if (!m_state)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+
+        if (!m_state->cancelled)
+        {
+            m_state->callbacks.push_back(std::move(callback));
+            return;
+        }
+    }
+
+    callback();
+}
+
+CancellationToken ActionServer::cancellation(std::string const& id)
+{
+    std::lock_guard<std::mutex> lock(m_cancel_mutex);
+
+    auto it = m_cancels.find(id);
+    if (it == m_cancels.end())
+        return CancellationToken(nullptr);
+    return CancellationToken(it->second);
+}
+
+void ActionServer::M_track(std::string const& id)
+{
+    auto state = std::make_shared<detail::CancelState>();
+
+    std::lock_guard<std::mutex> lock(m_cancel_mutex);
+    m_cancels[id] = std::move(state);
+}
+
+void ActionServer::M_untrack(std::string const& id)
+{
+    std::lock_guard<std::mutex> lock(m_cancel_mutex);
+    m_cancels.erase(id);
+}
+
+void ActionServer::M_cancel(std::string const& id)
+{
+    std::shared_ptr<detail::CancelState> state;
+
+    {
+        std::lock_guard<std::mutex> lock(m_cancel_mutex);
+
+        // Cancellations of finished actions are late, ignore them
+        auto it = m_cancels.find(id);
+        if (it == m_cancels.end())
+            return;
+        state = it->second;
+    }
+
+    std::vector<std::function<void()>> callbacks;
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->cancelled = true;
+        callbacks.swap(state->callbacks);
+    }
+
+    for (auto& callback : callbacks)
+        callback();
+}
 
 std::string ActionServer::generateId()
 {
-    boost::uuids::uuid u = boost::uuids::random_generator()();
+    // Seeding a generator is expensive, keep one per thread
+    static thread_local boost::uuids::random_generator generator;
+
+    boost::uuids::uuid u = generator();
     std::string as_hex;
+    as_hex.reserve(2 * u.size());
     boost::algorithm::hex(u.begin(), u.end(), std::back_inserter(as_hex));
-    return std::move(as_hex);
+    return as_hex;
 }
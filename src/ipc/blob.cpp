@@ -0,0 +1,343 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lesf/ipc/blob.h"
+#include "lesf/ipc/exception.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <boost/interprocess/managed_shared_memory.hpp>
+
+using namespace boost::interprocess;
+
+using namespace lesf;
+using namespace ipc;
+
+class BlobArena::Internals
+{
+public:
+    Internals(std::string const& name, std::size_t size, bool create) :
+        segment(create ? managed_shared_memory(create_only, name.c_str(), size)
+                       : managed_shared_memory(open_only, name.c_str()))
+    {}
+
+    managed_shared_memory segment;
+};
+
+// The current arena is per thread, as each endpoint has its own receiving thread
+static thread_local BlobArena::Scope* current_scope = 0;
+
+BlobArena::Scope::Scope(BlobArena* arena) :
+    m_arena(arena),
+    m_previous(current_scope),
+    m_received(0)
+{
+    current_scope = this;
+}
+
+BlobArena::Scope::~Scope()
+{
+    current_scope = m_previous;
+}
+
+std::size_t BlobArena::Scope::received() const
+{
+    return m_received;
+}
+
+BlobArena::BlobArena(std::string const& name, std::size_t size, bool create) :
+    m_name(name),
+    m_owner(create)
+{
+    // Same as for endpoints, remove any leftover from a crashed program
+    if (create)
+        shared_memory_object::remove(name.c_str());
+
+    try {
+        m_internals = new Internals(name, size, create);
+    } catch (interprocess_exception const& exc) {
+        LESF_CORE_THROW(SharedMemoryException, "unable to " << (create ? "create" : "open") << " IPC blob arena `" << name << "` : " << exc.what());
+    }
+}
+
+BlobArena::~BlobArena()
+{
+    delete m_internals;
+
+    if (m_owner)
+        shared_memory_object::remove(m_name.c_str());
+}
+
+char* BlobArena::allocate(std::size_t size)
+{
+    void* data = m_internals->segment.allocate(size, std::nothrow);
+    if (!data)
+        LESF_CORE_THROW(SharedMemoryException, "unable to allocate " << size << " bytes in IPC blob arena `" << m_name << "` ("
+                        << m_internals->segment.get_free_memory() << " bytes free)");
+
+    return static_cast<char*>(data);
+}
+
+void BlobArena::deallocate(char* data)
+{
+    m_internals->segment.deallocate(data);
+}
+
+std::size_t BlobArena::offsetOf(const char* data) const
+{
+    return m_internals->segment.get_handle_from_address(data);
+}
+
+char* BlobArena::addressOf(std::size_t offset) const
+{
+    return static_cast<char*>(m_internals->segment.get_address_from_handle(offset));
+}
+
+std::size_t BlobArena::size() const
+{
+    return m_internals->segment.get_size();
+}
+
+BlobArena* BlobArena::current()
+{
+    return current_scope ? current_scope->m_arena : 0;
+}
+
+// Every block starts with this header, so that the receiver can check that a
+//   reference designates a block that was handed over, and claim it once.
+//   Malformed, stale or duplicated references are rejected instead of being
+//   freed (which would corrupt the arena).
+struct Blob::Header
+{
+    enum State : std::uint32_t
+    {
+        Free = 0,
+        Owned, // By the sender, or the receiver once claimed
+        Sent // Serialized into a message, to be claimed by the receiver
+    };
+
+    static const std::uint64_t Magic = 0x6c65736662626c62ULL;
+
+    std::uint64_t magic;
+    std::uint64_t offset; // Of the data, as found in references
+    std::uint64_t size;
+    std::atomic<std::uint32_t> state;
+};
+
+// Shared by all copies of a blob. The block is given back to the arena when
+//   the last copy dies, unless it was handed over to another process.
+struct Blob::Storage
+{
+    Storage(BlobArena* arena, Header* header, bool received) :
+        arena(arena),
+        header(header),
+        data(reinterpret_cast<char*>(header + 1)),
+        size(header->size),
+        owned(true),
+        sending(false),
+        received(received)
+    {}
+
+    ~Storage()
+    {
+        if (owned)
+        {
+            // Stale references to the block must not match anymore
+            header->magic = 0;
+            header->state.store(Header::Free, std::memory_order_relaxed);
+            arena->deallocate(reinterpret_cast<char*>(header));
+        }
+    }
+
+    BlobArena* arena;
+    Header* header;
+    char* data;
+    std::size_t size;
+    bool owned;
+    bool sending; // Serialized into a message not sent yet
+    bool received; // Read-only
+};
+
+// The current transfer is per thread, as for arenas
+static thread_local Blob::Transfer* current_transfer = 0;
+
+Blob::Transfer::Transfer() :
+    m_previous(current_transfer)
+{
+    current_transfer = this;
+}
+
+Blob::Transfer::~Transfer()
+{
+    current_transfer = m_previous;
+
+    // Not committed, the blobs can be sent again
+    for (auto const& storage : m_blobs)
+    {
+        storage->header->state.store(Header::Owned, std::memory_order_relaxed);
+        storage->sending = false;
+    }
+}
+
+void Blob::Transfer::commit()
+{
+    // From now on the blocks belong to the receiver
+    for (auto const& storage : m_blobs)
+    {
+        storage->owned = false;
+        storage->sending = false;
+    }
+
+    m_blobs.clear();
+}
+
+bool Blob::Transfer::empty() const
+{
+    return m_blobs.empty();
+}
+
+void Blob::Transfer::M_add(std::shared_ptr<Storage> const& storage)
+{
+    // Claimable as soon as the message is sent, which may be before commit()
+    storage->header->state.store(Header::Sent, std::memory_order_release);
+    storage->sending = true;
+    m_blobs.push_back(storage);
+}
+
+Blob::Blob() :
+    m_storage()
+{}
+
+Blob::Blob(BlobArena& arena, std::size_t size) :
+    m_storage()
+{
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "blob headers need lock-free atomics to be shared between processes");
+    static_assert(sizeof(Header) % 16 == 0, "blob headers must keep the data aligned");
+
+    Header* header = reinterpret_cast<Header*>(arena.allocate(sizeof(Header) + size));
+    header->magic = Header::Magic;
+    header->offset = arena.offsetOf(reinterpret_cast<char*>(header + 1));
+    header->size = size;
+    new (&header->state) std::atomic<std::uint32_t>(Header::Owned);
+
+    try {
+        m_storage = std::make_shared<Storage>(&arena, header, false);
+    } catch (...) {
+        arena.deallocate(reinterpret_cast<char*>(header));
+        throw;
+    }
+}
+
+Blob::~Blob()
+{}
+
+bool Blob::empty() const
+{
+    return !m_storage;
+}
+
+std::size_t Blob::size() const
+{
+    return m_storage ? m_storage->size : 0;
+}
+
+char* Blob::data()
+{
+    return m_storage && !m_storage->received ? m_storage->data : 0;
+}
+
+const char* Blob::data() const
+{
+    return m_storage ? m_storage->data : 0;
+}
+
+// Blobs are represented as an "<offset>:<size>" string in JSON data, or an
+//   empty string for empty blobs.
+void Blob::M_extract(lconf::json::Node* node)
+{
+    lconf::json::StringNode* str = node->downcast<lconf::json::StringNode>();
+    if (!str)
+        throw lconf::json::Exception(node, "blob reference must be a string");
+
+    std::string const& ref = str->value();
+    if (ref.empty())
+    {
+        m_storage.reset();
+        return;
+    }
+
+    BlobArena* arena = BlobArena::current();
+    if (!arena)
+        throw lconf::json::Exception(node, "blob received outside of an endpoint");
+
+    char* end;
+    std::size_t offset = std::strtoull(ref.c_str(), &end, 10);
+    if (end == ref.c_str() || *end != ':')
+        throw lconf::json::Exception(node, "invalid blob reference");
+    const char* size_str = end+1;
+    std::size_t size = std::strtoull(size_str, &end, 10);
+    if (end == size_str || *end)
+        throw lconf::json::Exception(node, "invalid blob reference");
+
+    // Don't trust the peer with addresses outside of the arena, or that are
+    //   not the data of a block it handed over
+    if (offset < sizeof(Header) || offset > arena->size() || size > arena->size() - offset ||
+        (offset - sizeof(Header)) % alignof(Header))
+        throw lconf::json::Exception(node, "blob reference out of the arena");
+
+    Header* header = reinterpret_cast<Header*>(arena->addressOf(offset - sizeof(Header)));
+    if (header->magic != Header::Magic || header->offset != offset || header->size != size)
+        throw lconf::json::Exception(node, "invalid blob reference");
+
+    // Only the first of duplicated references gets the block
+    std::uint32_t expected = Header::Sent;
+    if (!header->state.compare_exchange_strong(expected, Header::Owned, std::memory_order_acquire))
+        throw lconf::json::Exception(node, "blob reference was not handed over");
+
+    try {
+        m_storage = std::make_shared<Storage>(arena, header, true);
+    } catch (...) {
+        header->state.store(Header::Sent, std::memory_order_relaxed);
+        throw;
+    }
+
+    ++current_scope->m_received;
+}
+
+lconf::json::Node* Blob::M_synthetize() const
+{
+    if (!m_storage)
+        return new lconf::json::StringNode("");
+
+    if (!m_storage->owned || m_storage->sending)
+        LESF_CORE_THROW(DataFormatException, "IPC blob was already sent");
+
+    if (m_storage->received)
+        LESF_CORE_THROW(DataFormatException, "received IPC blobs can't be sent again");
+
+    if (!current_transfer)
+        LESF_CORE_THROW(DataFormatException, "IPC blob can only be sent by an endpoint");
+
+    // Handed over once the message is sent
+    current_transfer->M_add(m_storage);
+
+    return new lconf::json::StringNode(std::to_string(m_storage->arena->offsetOf(m_storage->data)) + ":" +
+                                       std::to_string(m_storage->size));
+}
@@ -0,0 +1,157 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lesf/ipc/capture.h"
+#include "lesf/ipc/endpoint.h"
+#include "lesf/ipc/exception.h"
+
+#include <thread>
+#include <cstring>
+
+using namespace lesf;
+using namespace ipc;
+
+// Capture files start with this, followed by the records. Each record is made
+//   of a CaptureRecordHeader, the type identifier and the frame.
+static const char CaptureMagic[8] = { 'L', 'E', 'S', 'F', 'C', 'A', 'P', '1' };
+
+// Size of the write buffer of captures
+static const std::size_t CaptureBufferSize = 256UL * 1024UL;
+
+struct CaptureRecordHeader
+{
+    std::uint64_t timestamp;
+    std::uint8_t direction;
+    std::uint8_t id_size;
+    std::uint16_t channel;
+    std::uint32_t size;
+};
+
+Capture::Capture(std::string const& path) :
+    m_buffer(CaptureBufferSize),
+    m_start(std::chrono::steady_clock::now())
+{
+    // The buffer must be set before opening the file to be used
+    m_file.rdbuf()->pubsetbuf(m_buffer.data(), m_buffer.size());
+    m_file.open(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!m_file)
+        LESF_CORE_THROW(DataFormatException, "unable to create IPC capture file `" << path << "`");
+
+    m_file.write(CaptureMagic, sizeof(CaptureMagic));
+}
+
+Capture::~Capture()
+{
+    m_file.close();
+}
+
+void Capture::record(Direction direction, unsigned channel, std::string const& type_id, const char* data, std::size_t size)
+{
+    CaptureRecordHeader header;
+    header.direction = direction;
+    header.id_size = type_id.size() > 0xFF ? 0xFF : type_id.size();
+    header.channel = channel;
+    header.size = size;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Timestamped under the lock, so that records are written in order
+    header.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_file.write(type_id.data(), header.id_size);
+    m_file.write(data, size);
+}
+
+void Capture::flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file.flush();
+}
+
+CaptureReader::CaptureReader(std::string const& path) :
+    m_path(path),
+    m_file(path.c_str(), std::ios::binary)
+{
+    char magic[sizeof(CaptureMagic)];
+    if (!m_file.read(magic, sizeof(magic)) || std::memcmp(magic, CaptureMagic, sizeof(magic)))
+        LESF_CORE_THROW(DataFormatException, "`" << path << "` is not a valid IPC capture file");
+}
+
+bool CaptureReader::next(Capture::Record& record)
+{
+    CaptureRecordHeader header;
+    if (!m_file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    {
+        if (m_file.gcount() == 0)
+            return false;
+        LESF_CORE_THROW(DataFormatException, "IPC capture file `" << m_path << "` is truncated");
+    }
+
+    record.timestamp = header.timestamp;
+    record.direction = static_cast<Capture::Direction>(header.direction);
+    record.channel = header.channel;
+    record.type_id.resize(header.id_size);
+    record.data.resize(header.size);
+
+    if (!m_file.read(&record.type_id[0], header.id_size) || !m_file.read(&record.data[0], header.size))
+        LESF_CORE_THROW(DataFormatException, "IPC capture file `" << m_path << "` is truncated");
+
+    return true;
+}
+
+Replayer::Replayer(std::string const& path) :
+    m_path(path)
+{}
+
+std::size_t Replayer::replay(Endpoint& ep, Capture::Direction direction, double speed)
+{
+    CaptureReader reader(m_path);
+    Capture::Record record;
+
+    std::size_t count = 0;
+    std::uint64_t first_timestamp = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    while (reader.next(record))
+    {
+        if (record.direction != direction)
+            continue;
+
+        if (!count)
+            first_timestamp = record.timestamp;
+
+        // Keep the original pace (scaled by speed) relative to the first frame,
+        //   records older than it (from captures written before records were
+        //   ordered) are sent right away
+        if (speed > 0 && record.timestamp > first_timestamp)
+        {
+            auto delay = std::chrono::nanoseconds(static_cast<std::uint64_t>((record.timestamp - first_timestamp) / speed));
+            std::this_thread::sleep_until(start + delay);
+        }
+
+        if (record.channel >= ep.channels())
+            LESF_CORE_THROW(DataFormatException, "IPC capture file `" << m_path << "` has frames on channel " << record.channel
+                            << ", the endpoint only has " << ep.channels() << " channel(s)");
+
+        ep.M_sendFrame(record.channel, record.type_id, record.data.data(), record.data.size());
+        ++count;
+    }
+
+    return count;
+}
@@ -0,0 +1,326 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lesf/ipc/durable_endpoint.h"
+#include "lesf/ipc/exception.h"
+
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+using namespace boost::interprocess;
+
+using namespace lesf;
+using namespace ipc;
+
+// Identifies a valid queue file, written last when the file is created
+static const std::uint64_t DurableMagic = 0x4C45534644513031ULL; // "LESFDQ01"
+
+// The consumer checks for new records at this rate when the queue is empty
+static const long ReceivePollPeriodMs = 1;
+
+// Records are aligned on this size in the ring buffer
+static const std::size_t RecordAlignment = 8;
+
+// This structure is at the beginning of the file. It is followed by the ring
+//   buffer holding the records.
+// Offsets count bytes since the creation of the queue, their position in the
+//   ring buffer is taken modulo its capacity.
+struct DurableHeader
+{
+    std::uint64_t magic;
+    std::uint64_t capacity; // Size of the ring buffer
+    std::atomic<std::uint64_t> write_offset; // End of the last complete record
+    std::atomic<std::uint64_t> read_offset; // End of the last record handled by the consumer
+
+    // Offset of the ring buffer from the start of the file
+    static std::size_t ringOffset()
+    {
+        return (sizeof(DurableHeader) + 63) / 64 * 64;
+    }
+};
+
+// Each record starts with this header. When a record does not fit before the
+//   end of the ring buffer, the remaining space is filled with a padding record
+//   and the record is written at the beginning.
+struct RecordHeader
+{
+    enum Kind
+    {
+        MessageRecord = 1,
+        PaddingRecord = 2
+    };
+
+    std::uint32_t size; // Size of the payload, without alignment
+    std::uint32_t kind;
+};
+
+static std::uint64_t recordSize(std::size_t payload_size)
+{
+    return sizeof(RecordHeader) + (payload_size + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+}
+
+class DurableEndpoint::Internals
+{
+public:
+    Internals(std::string const& path) :
+        mapping(path.c_str(), read_write),
+        lock(path.c_str())
+    {}
+
+    file_mapping mapping; // File descriptor
+    mapped_region map; // Memory map to access the file
+    file_lock lock; // Serializes producers of all processes (released by the system if one dies)
+    std::mutex mutex; // Serializes producers of this process, file locks are per process
+
+    DurableHeader* header;
+    char* ring;
+};
+
+DurableEndpoint::DurableEndpoint(Role role, std::string const& path, std::size_t capacity) :
+    m_role(role),
+    m_path(path),
+    m_internals(0),
+    m_stop(false),
+    m_exc_handler(0)
+{
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ipc::DurableEndpoint needs lock-free 64-bit atomics to be used across processes");
+
+    capacity = (capacity + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+
+    try {
+        // Make sure the file exists, without truncating it
+        {
+            std::ofstream touch(path.c_str(), std::ios::binary | std::ios::app);
+            if (!touch)
+                LESF_CORE_THROW(SharedMemoryException, "unable to open durable IPC endpoint `" << path << "` : can't create file");
+        }
+
+        m_internals = new Internals(path);
+
+        // The first one to get here initializes the file
+        scoped_lock<file_lock> lock(m_internals->lock);
+
+        std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+        std::size_t file_size = file.tellg();
+        file.close();
+
+        if (!file_size)
+        {
+            std::filebuf buf;
+            buf.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            buf.pubseekoff(DurableHeader::ringOffset() + capacity - 1, std::ios::beg);
+            buf.sputc(0);
+            buf.close();
+
+            m_internals->map = mapped_region(m_internals->mapping, read_write);
+            m_internals->header = static_cast<DurableHeader*>(m_internals->map.get_address());
+            m_internals->header->capacity = capacity;
+            new (&m_internals->header->write_offset) std::atomic<std::uint64_t>(0);
+            new (&m_internals->header->read_offset) std::atomic<std::uint64_t>(0);
+            m_internals->map.flush();
+            m_internals->header->magic = DurableMagic;
+            m_internals->map.flush();
+        }
+        else
+        {
+            m_internals->map = mapped_region(m_internals->mapping, read_write);
+            m_internals->header = static_cast<DurableHeader*>(m_internals->map.get_address());
+
+            if (file_size < DurableHeader::ringOffset() ||
+                m_internals->header->magic != DurableMagic ||
+                file_size < DurableHeader::ringOffset() + m_internals->header->capacity)
+            {
+                LESF_CORE_THROW(SharedMemoryException, "unable to open durable IPC endpoint `" << path << "` : not a valid queue file");
+            }
+        }
+
+        m_internals->ring = static_cast<char*>(m_internals->map.get_address()) + DurableHeader::ringOffset();
+
+    } catch (interprocess_exception const& exc) {
+        delete m_internals;
+        LESF_CORE_THROW(SharedMemoryException, "unable to open durable IPC endpoint `" << path << "` : " << exc.what());
+    } catch (...) {
+        delete m_internals;
+        throw;
+    }
+}
+
+DurableEndpoint::~DurableEndpoint()
+{
+    // Stop the receiving thread, if started
+    if (m_receive_thread.joinable())
+    {
+        m_stop = true;
+        m_receive_thread.join();
+    }
+
+    // The file is kept, this is the whole point
+    delete m_internals;
+
+    if (m_exc_handler)
+        delete m_exc_handler;
+}
+
+void DurableEndpoint::send(Message const& msg)
+{
+    if (m_role != Producer)
+        LESF_CORE_THROW(SharedMemoryException, "durable IPC endpoint `" << m_path << "` : only producers can send");
+
+    DurableHeader* header = m_internals->header;
+    std::uint64_t capacity = header->capacity;
+
+    // Serialize before taking the locks
+    std::string data = MessageFactory::serialize(msg);
+    std::uint64_t record_size = recordSize(data.size());
+    if (record_size > capacity)
+        LESF_CORE_THROW(SharedMemoryException, "IPC packet size (" << data.size() << ") exceeds durable queue capacity (" << capacity << ")");
+
+    std::lock_guard<std::mutex> local_lock(m_internals->mutex);
+    scoped_lock<file_lock> lock(m_internals->lock);
+
+    std::uint64_t write = header->write_offset.load(std::memory_order_relaxed);
+    std::uint64_t read = header->read_offset.load(std::memory_order_acquire);
+
+    // Records are never split, skip the end of the ring buffer if needed
+    std::uint64_t pos = write % capacity;
+    std::uint64_t padding = capacity - pos < record_size ? capacity - pos : 0;
+
+    if (write + padding + record_size - read > capacity)
+        LESF_CORE_THROW(SharedMemoryException, "durable IPC endpoint `" << m_path << "` is full (" << (write - read) << " bytes queued)");
+
+    if (padding)
+    {
+        RecordHeader* rec = reinterpret_cast<RecordHeader*>(m_internals->ring + pos);
+        rec->size = padding - sizeof(RecordHeader);
+        rec->kind = RecordHeader::PaddingRecord;
+        write += padding;
+        pos = 0;
+    }
+
+    RecordHeader* rec = reinterpret_cast<RecordHeader*>(m_internals->ring + pos);
+    rec->size = data.size();
+    rec->kind = RecordHeader::MessageRecord;
+    std::memcpy(rec + 1, data.data(), data.size());
+
+    // Publish the record(s), a producer dying before this point leaves no trace
+    header->write_offset.store(write + record_size, std::memory_order_release);
+}
+
+void DurableEndpoint::flush()
+{
+    m_internals->map.flush();
+}
+
+void DurableEndpoint::registerExceptionHandler(std::function<void(core::RecoverableException const&)> const& handler)
+{
+    if (m_exc_handler)
+        delete m_exc_handler;
+
+    m_exc_handler = new std::function<void(core::RecoverableException const&)>(handler);
+}
+
+void DurableEndpoint::start()
+{
+    if (m_role != Consumer)
+        LESF_CORE_THROW(SharedMemoryException, "durable IPC endpoint `" << m_path << "` : only consumers can receive");
+
+    if (m_receive_thread.joinable())
+        return;
+
+    m_receive_thread = std::thread(&DurableEndpoint::M_receiveThread, this);
+}
+
+void DurableEndpoint::M_receiveThread()
+{
+    DurableHeader* header = m_internals->header;
+    std::uint64_t capacity = header->capacity;
+
+    while (!m_stop)
+    {
+        std::uint64_t read = header->read_offset.load(std::memory_order_relaxed);
+        std::uint64_t write = header->write_offset.load(std::memory_order_acquire);
+
+        if (read == write)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ReceivePollPeriodMs));
+            continue;
+        }
+
+        RecordHeader const* rec = reinterpret_cast<RecordHeader const*>(m_internals->ring + read % capacity);
+        std::uint64_t record_size = recordSize(rec->size);
+
+        if ((rec->kind != RecordHeader::MessageRecord && rec->kind != RecordHeader::PaddingRecord) ||
+            read % capacity + record_size > capacity || read + record_size > write)
+        {
+            // Nothing sensible can be done with the rest of the queue
+            header->read_offset.store(write, std::memory_order_release);
+
+            try {
+                LESF_CORE_THROW(DataFormatException, "corrupted record in durable IPC endpoint `" << m_path << "`, "
+                                << (write - read) << " bytes dropped");
+            } catch (core::RecoverableException const& exc) {
+                if (m_exc_handler)
+                    (*m_exc_handler)(exc);
+            }
+            continue;
+        }
+
+        if (rec->kind == RecordHeader::MessageRecord)
+            M_dispatch(reinterpret_cast<const char*>(rec + 1), rec->size);
+
+        // Commit our offset only once the message is handled
+        header->read_offset.store(read + record_size, std::memory_order_release);
+    }
+}
+
+void DurableEndpoint::M_dispatch(const char* data, std::size_t size)
+{
+    try {
+        Message* msg = 0;
+
+        // We must respect RAII when an exception is thrown so that msg
+        //   is properly deleted
+        struct deleter {
+            deleter(Message** msg) : msg(msg) {}
+            ~deleter() { if (*msg) delete *msg; }
+            Message** msg;
+        } _deleter(&msg);
+
+        // Construct the message from the record, which stays in place until
+        //   we commit our offset
+        std::string type_id;
+        msg = MessageFactory::construct(data, size, &type_id);
+
+        // Call the appropriate slot
+        auto it = m_slots.find(type_id);
+        if (it == m_slots.end())
+            LESF_CORE_THROW(DataFormatException, "IPC message type `" + type_id + "`is not connected to any slot");
+
+        it->second(*this, *msg);
+    } catch (core::RecoverableException const& exc) {
+        if (m_exc_handler)
+            (*m_exc_handler)(exc);
+    } // other exceptions will call std::terminate()
+}
@@ -21,17 +21,42 @@
 #include "lesf/ipc/message_factory.h"
 
 #include <atomic>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <boost/interprocess/shared_memory_object.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/sync/interprocess_semaphore.hpp>
 #include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/date_time/gregorian/gregorian_types.hpp>
 
 using namespace boost::interprocess;
 
 using namespace lesf;
 using namespace ipc;
 
+// Receivers may share a doorbell with other processes (see ipc::Endpoint::Worker),
+//   so a stop request can be consumed by another receiver. Receiving threads
+//   therefore also wake up periodically to check for pending data and stop
+//   requests, but only while workers are attached.
+static const long ReceivePollPeriodMs = 100;
+
+// Absolute deadline for interprocess timed waits. This avoids
+//   microsec_clock::universal_time(), which goes through gmtime_r() and its
+//   process-wide lock (which a child process may inherit locked from fork()).
+static boost::posix_time::ptime receiveDeadline()
+{
+    static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch());
+    return epoch + boost::posix_time::microseconds(now.count()) + boost::posix_time::milliseconds(ReceivePollPeriodMs);
+}
+
 // This structure represents a one-way shared buffer between two processes.
+// Each channel of an endpoint has two of them (one per direction).
 struct Endpoint::SharedBuffer
 {
 public:
@@ -39,59 +64,158 @@ public:
         mutex(1),
         sem_empty(1),
         sem_full(0),
-        shutdown(false)
+        size(0)
     {}
 
     interprocess_semaphore mutex; // Protect access to the queue
     interprocess_semaphore sem_empty; // Semaphore to wait on when no data
     interprocess_semaphore sem_full; // Semaphore to wait on when data is here
 
-    bool shutdown; // This flag is used to stop the receiver thread
+    std::size_t size; // Size of the data currently held in buffer
     char buffer[Endpoint::MaxMessageSize];
 };
 
-// This is the actual data shared between client and server processes
+// Receivers wait on a single doorbell per direction, rung once for each message
+//   sent on any channel. This allows a single thread to serve all channels, and
+//   several worker processes to compete for the messages sent to a server.
+struct Endpoint::SharedDoorbell
+{
+public:
+    SharedDoorbell() :
+        sem(0)
+    {}
+
+    interprocess_semaphore sem; // Semaphore to wait on until any channel has data
+};
+
+// This is the actual data shared between client and server processes.
+// It is followed in the shared memory by the buffers of each channel.
 struct Endpoint::SharedData
 {
+    enum Direction
+    {
+        ServerToClient = 0,
+        ClientToServer = 1
+    };
+
+    SharedData(unsigned channels) :
+        channels(channels),
+        workers(0),
+        server_waiting(false)
+    {
+        for (unsigned i = 0; i < 2 * channels; ++i)
+            new (&M_buffers()[i]) SharedBuffer();
+    }
+
+    ~SharedData()
+    {
+        for (unsigned i = 0; i < 2 * channels; ++i)
+            M_buffers()[i].~SharedBuffer();
+    }
+
+    // Total size of the shared data for the given number of channels
+    static std::size_t size(unsigned channels)
+    {
+        return M_buffersOffset() + 2 * channels * sizeof(SharedBuffer);
+    }
+
+    SharedBuffer* buffer(unsigned channel, unsigned direction)
+    {
+        return &M_buffers()[2 * channel + direction];
+    }
+
     interprocess_mutex client_mutex; // Only allow a single client per endpoint
-    Endpoint::SharedBuffer buffers[2]; // The two buffers for full duplex IPC
+    unsigned channels; // Number of logical channels in this endpoint
+    Endpoint::SharedDoorbell doorbells[2]; // One doorbell per direction
+
+    // The server waits for its doorbell without polling while it has no
+    //   workers, so an attaching worker rings it as long as it does
+    //   (lock-free atomics work across processes)
+    std::atomic<unsigned> workers;
+    std::atomic<bool> server_waiting;
+
+private:
+    static std::size_t M_buffersOffset()
+    {
+        return (sizeof(SharedData) + alignof(SharedBuffer) - 1) / alignof(SharedBuffer) * alignof(SharedBuffer);
+    }
+
+    SharedBuffer* M_buffers()
+    {
+        return reinterpret_cast<SharedBuffer*>(reinterpret_cast<char*>(this) + M_buffersOffset());
+    }
 };
 
 // This structure is used to hold information about the shared memory between
-//   the two processes. It contains two Endpoint::SharedData one-way buffers
-//   to implement a full-duplex endpoint.
+//   the two processes. It is owned by the endpoint that opened the shared
+//   memory, and shared with the endpoints opened on its other channels.
 struct Endpoint::SharedMem
 {
     shared_memory_object* shm; // Shared memory descriptor
     mapped_region* map; // Memory map to access shared memory
     Endpoint::SharedData* data; // Actual shared data structure in the map
-    Endpoint::SharedBuffer* send_buf; // Pointer to the send buffer in .data (because clients have the opposite from servers)
-    Endpoint::SharedBuffer* recv_buf; // Pointer to the receive buffer in .data
+    unsigned send_dir; // Direction we send in (because clients have the opposite from servers)
+    unsigned recv_dir; // Direction we receive from
+
+    std::recursive_mutex channels_mutex; // Protect channel_eps (and their receive gates)
+    std::vector<Endpoint*> channel_eps; // Endpoint opened on each channel, if any
+
+    std::atomic<bool> stop; // This flag is used to stop the receiving thread
+
+    // Set by the receiving thread before checking receive gates, and reset by
+    //   notifyReceiveGate(), which then wakes it up
+    std::atomic<bool> gate_declined;
+    std::mutex gate_mutex;
+    std::condition_variable gate_cond;
+};
+
+// Messages posted to an endpoint (see ipc::Endpoint::post()), already serialized
+struct Endpoint::Poster
+{
+    Poster() :
+        stop(false)
+    {}
+
+    std::mutex mutex; // Protect frames and thread
+    std::condition_variable cond; // Notified when a frame is posted or when stopping
+    std::deque<std::pair<std::string, std::string>> frames; // Type identifier (for captures) and frame
+    std::atomic<bool> stop;
+    std::thread thread;
 };
 
-Endpoint::Endpoint(Endpoint::Role role, std::string const& name) :
+Endpoint::Endpoint(Endpoint::Role role, std::string const& name, unsigned channels) :
     m_role(role),
     m_name(name),
+    m_root(this),
+    m_channel(0),
+    m_blobs(0),
+    m_capture(0),
+    m_poster(0),
     m_exc_handler(0)
 {
     if (role == Server)
     {
+        if (!channels)
+            LESF_CORE_THROW(SharedMemoryException, "unable to create IPC endpoint `" << name << "` : at least one channel is needed");
+
         // Normally not required, but we do it anyway to avoid problems if the
         //   program crashed and didn't remove the resource from the system
         shared_memory_object::remove(name.c_str());
 
         try {
             m_shared = new SharedMem();
+            m_shared->stop = false;
+            m_shared->gate_declined = false;
 
             // Create the shared memory region
             m_shared->shm = new shared_memory_object(create_only, name.c_str(), read_write);
-            m_shared->shm->truncate(2 * sizeof(SharedData));
+            m_shared->shm->truncate(SharedData::size(channels));
             m_shared->map = new mapped_region(*m_shared->shm, read_write);
 
             // Construct our shared memory space
-            m_shared->data = new (m_shared->map->get_address()) SharedData();
-            m_shared->send_buf = &m_shared->data->buffers[0];
-            m_shared->recv_buf = &m_shared->data->buffers[1];
+            m_shared->data = new (m_shared->map->get_address()) SharedData(channels);
+            m_shared->send_dir = SharedData::ServerToClient;
+            m_shared->recv_dir = SharedData::ClientToServer;
 
         } catch (interprocess_exception const& exc) {
             LESF_CORE_THROW(SharedMemoryException, "unable to create IPC endpoint `" << name << "` : " << exc.what());
@@ -101,18 +225,29 @@ Endpoint::Endpoint(Endpoint::Role role, std::string const& name) :
     {
         try {
             m_shared = new SharedMem();
+            m_shared->stop = false;
+            m_shared->gate_declined = false;
 
             // Open the shared memory region created by the server
             m_shared->shm = new shared_memory_object(open_only, name.c_str(), read_write);
             m_shared->map = new mapped_region(*m_shared->shm, read_write);
 
             // Retrieve our shared memory space, initialized by the server
+            // Workers take the server side, alongside the server itself
             m_shared->data = static_cast<SharedData*>(m_shared->map->get_address());
-            m_shared->send_buf = &m_shared->data->buffers[1];
-            m_shared->recv_buf = &m_shared->data->buffers[0];
+            if (role == Worker)
+            {
+                m_shared->send_dir = SharedData::ServerToClient;
+                m_shared->recv_dir = SharedData::ClientToServer;
+            }
+            else
+            {
+                m_shared->send_dir = SharedData::ClientToServer;
+                m_shared->recv_dir = SharedData::ServerToClient;
+            }
 
             // Check if another client is already connected, if not acquire the client mutex
-            /*if (!m_shared->data->client_mutex.try_lock())
+            /*if (role == Client && !m_shared->data->client_mutex.try_lock())
             {
                 delete m_shared->map;
                 delete m_shared->shm;
@@ -124,19 +259,108 @@ Endpoint::Endpoint(Endpoint::Role role, std::string const& name) :
         } catch (interprocess_exception const& exc) {
             LESF_CORE_THROW(SharedMemoryException, "unable to open IPC endpoint `" << name << "` : " << exc.what());
         }
+
+        // The number of channels is chosen by the server
+        if (m_shared->map->get_size() < SharedData::size(m_shared->data->channels))
+        {
+            delete m_shared->map;
+            delete m_shared->shm;
+            delete m_shared;
+
+            LESF_CORE_THROW(SharedMemoryException, "unable to open IPC endpoint `" << name << "` : shared memory is too small");
+        }
+    }
+
+    // The server side creates the blob arena, the client side opens it
+    try {
+        m_blobs = new BlobArena(name + ".blobs", BlobArenaSize, role == Server);
+    } catch (...) {
+        if (role == Server)
+            m_shared->data->~SharedData();
+        delete m_shared->map;
+        delete m_shared->shm;
+        delete m_shared;
+        if (role == Server)
+            shared_memory_object::remove(name.c_str());
+        throw;
+    }
+
+    // We are the endpoint of the first channel
+    m_shared->channel_eps.assign(m_shared->data->channels, 0);
+    m_shared->channel_eps[0] = this;
+
+    // Make the server poll its doorbell from now on, it may be waiting for it
+    //   without (the ring can't be taken by our receiving thread yet, maybe
+    //   by other workers, so retry as long as it is not awake)
+    if (role == Worker)
+    {
+        ++m_shared->data->workers;
+
+        for (unsigned i = 0; m_shared->data->server_waiting && i < ReceivePollPeriodMs; ++i)
+        {
+            m_shared->data->doorbells[m_shared->recv_dir].sem.post();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
     }
 
+    m_poster = new Poster();
     m_receive_thread = std::thread(&Endpoint::M_receiveThread, this);
 }
 
+Endpoint::Endpoint(Endpoint& parent, unsigned channel) :
+    m_role(parent.m_role),
+    m_name(parent.m_name),
+    m_root(parent.m_root),
+    m_channel(channel),
+    m_shared(parent.m_shared),
+    m_blobs(parent.m_blobs),
+    m_capture(0),
+    m_poster(0),
+    m_exc_handler(0)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+
+    if (channel >= m_shared->channel_eps.size())
+        LESF_CORE_THROW(SharedMemoryException, "unable to open channel " << channel << " of IPC endpoint `" << m_name << "` : "
+                        "it only has " << m_shared->channel_eps.size() << " channel(s)");
+
+    if (m_shared->channel_eps[channel])
+        LESF_CORE_THROW(SharedMemoryException, "unable to open channel " << channel << " of IPC endpoint `" << m_name << "` : already opened");
+
+    m_shared->channel_eps[channel] = this;
+    m_poster = new Poster();
+}
+
 Endpoint::~Endpoint()
 {
-    // Set the shutdown flag and make sure to unblock the receiving thread
-    m_shared->recv_buf->shutdown = true;
-    m_shared->recv_buf->sem_full.post();
+    // Endpoints opened on a channel only need to detach from the receiving
+    //   thread (this waits for any running slot of ours to complete), and
+    //   to stop posting messages
+    if (m_root != this)
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+            m_shared->channel_eps[m_channel] = 0;
+        }
+
+        M_stopPosting();
+
+        if (m_exc_handler)
+            delete m_exc_handler;
+        return;
+    }
+
+    // Set the stop flag and try to unblock the receiving thread (if another
+    //   receiver takes this wakeup, ours will notice within its poll period)
+    m_shared->stop = true;
+    m_shared->data->doorbells[m_shared->recv_dir].sem.post();
     m_receive_thread.join();
-    // Don't leave this flag in case another client takes our place later on
-    m_shared->recv_buf->shutdown = false;
+
+    // Slots can't post messages anymore
+    M_stopPosting();
+
+    if (m_role == Worker)
+        --m_shared->data->workers;
 
     // Delete shared memory object if we own it
     if (m_role == Server)
@@ -146,7 +370,7 @@ Endpoint::~Endpoint()
         m_shared->data->~SharedData();
     }
     // Otherwise, allow other clients to connect by releasing the client mutex
-    else
+    else if (m_role == Client)
     {
         // m_shared->data->client_mutex.unlock();
     }
@@ -160,27 +384,227 @@ Endpoint::~Endpoint()
     if (m_role == Server)
         shared_memory_object::remove(m_name.c_str());
 
+    // Blobs still held by the user are invalidated from here
+    delete m_blobs;
+
     if (m_exc_handler)
         delete m_exc_handler;
 }
 
+unsigned Endpoint::channel() const
+{
+    return m_channel;
+}
+
+unsigned Endpoint::channels() const
+{
+    return m_shared->data->channels;
+}
+
+bool Endpoint::hasWorkers() const
+{
+    return m_role == Worker || m_shared->data->workers;
+}
+
 void Endpoint::send(Message const& msg)
 {
-    // Wait until shared data available
-    m_shared->send_buf->sem_empty.wait();
-    m_shared->send_buf->mutex.wait();
+    // The blobs of the message stay ours if it can't be sent
+    Blob::Transfer transfer;
+
+    // Serialize before taking the shared buffer, so that we don't hold it
+    //   longer than needed (nor leave it locked if this throws)
+    std::string json = MessageFactory::serialize(msg);
+
+    // The type identifier is only needed for captures, which leave out the
+    //   blob references (they are only valid for the blobs sent this time)
+    static const std::string no_type_id;
+    M_sendFrame(m_capture.load() && transfer.empty() ? MessageFactory::typeIdentifier(msg) : no_type_id,
+                json.data(), json.size());
+
+    transfer.commit();
+}
+
+void Endpoint::post(Message const& msg)
+{
+    M_post(msg, false);
+}
+
+bool Endpoint::tryPost(Message const& msg)
+{
+    return M_post(msg, true);
+}
+
+bool Endpoint::M_post(Message const& msg, bool bounded)
+{
+    // The blobs of the message can't fail to be sent once queued (but are
+    //   dropped along with the arena if the endpoint is destroyed before)
+    Blob::Transfer transfer;
 
-    // Write data to shared memory
     std::string json = MessageFactory::serialize(msg);
-    if (json.size()+1 > sizeof(m_shared->send_buf->buffer))
-        LESF_CORE_THROW(SharedMemoryException, "IPC packet size (" << json.size()+1 << ") exceeds limit (" << sizeof(m_shared->send_buf->buffer) << ")");
-    std::strcpy(m_shared->send_buf->buffer, json.c_str());
+    if (json.size() > MaxMessageSize)
+        LESF_CORE_THROW(SharedMemoryException, "IPC packet size (" << json.size() << ") exceeds limit (" << std::size_t(MaxMessageSize) << ")");
+
+    std::string type_id = m_capture.load() && transfer.empty() ? MessageFactory::typeIdentifier(msg) : std::string();
+
+    {
+        std::lock_guard<std::mutex> lock(m_poster->mutex);
+
+        // The blobs go back to the arena along with the transfer
+        if (bounded && m_poster->frames.size() >= MaxPostedMessages)
+            return false;
 
-    // std::cout << json << std::endl << std::endl;
+        if (!m_poster->thread.joinable())
+            m_poster->thread = std::thread(&Endpoint::M_postThread, this);
+
+        m_poster->frames.emplace_back(std::move(type_id), std::move(json));
+        m_poster->cond.notify_one();
+    }
+
+    transfer.commit();
+    return true;
+}
+
+void Endpoint::setCapture(Capture* capture)
+{
+    m_capture = capture;
+}
+
+void Endpoint::M_sendFrame(std::string const& type_id, const char* data, std::size_t size)
+{
+    M_sendFrame(m_channel, type_id, data, size);
+}
+
+void Endpoint::M_sendFrame(unsigned channel, std::string const& type_id, const char* data, std::size_t size)
+{
+    SharedBuffer* send_buf = m_shared->data->buffer(channel, m_shared->send_dir);
+
+    if (size > sizeof(send_buf->buffer))
+        LESF_CORE_THROW(SharedMemoryException, "IPC packet size (" << size << ") exceeds limit (" << sizeof(send_buf->buffer) << ")");
+
+    M_capture(Capture::Sent, channel, type_id, data, size);
+
+    // Wait until shared data available on our channel
+    send_buf->sem_empty.wait();
+    M_writeFrame(send_buf, data, size);
+}
+
+void Endpoint::M_writeFrame(SharedBuffer* buf, const char* data, std::size_t size)
+{
+    buf->mutex.wait();
+
+    // Write data to shared memory, the receiver parses it in place using
+    //   the size we store along
+    std::memcpy(buf->buffer, data, size);
+    buf->size = size;
 
     // Signal receiver that data is available
-    m_shared->send_buf->mutex.post();
-    m_shared->send_buf->sem_full.post();
+    buf->mutex.post();
+    buf->sem_full.post();
+    m_shared->data->doorbells[m_shared->send_dir].sem.post();
+}
+
+void Endpoint::M_stopPosting()
+{
+    // Drop the posted messages not sent yet
+    {
+        std::lock_guard<std::mutex> lock(m_poster->mutex);
+        m_poster->stop = true;
+        m_poster->cond.notify_all();
+    }
+
+    if (m_poster->thread.joinable())
+        m_poster->thread.join();
+    delete m_poster;
+}
+
+void Endpoint::M_postThread()
+{
+    SharedBuffer* send_buf = m_shared->data->buffer(m_channel, m_shared->send_dir);
+
+    for (;;)
+    {
+        std::pair<std::string, std::string> frame;
+
+        {
+            std::unique_lock<std::mutex> lock(m_poster->mutex);
+            m_poster->cond.wait(lock, [this]() { return m_poster->stop || !m_poster->frames.empty(); });
+
+            if (m_poster->stop)
+                break;
+
+            frame = std::move(m_poster->frames.front());
+            m_poster->frames.pop_front();
+        }
+
+        M_capture(Capture::Sent, m_channel, frame.first, frame.second.data(), frame.second.size());
+
+        // Same as M_sendFrame(), but don't wait forever for a peer that may be
+        //   gone when the endpoint is destroyed
+        while (!send_buf->sem_empty.timed_wait(receiveDeadline()))
+        {
+            if (m_poster->stop)
+                return;
+        }
+
+        M_writeFrame(send_buf, frame.second.data(), frame.second.size());
+    }
+}
+
+Blob Endpoint::allocateBlob(std::size_t size)
+{
+    return Blob(*m_blobs, size);
+}
+
+void Endpoint::M_setSlot(std::string const& type_id, std::function<void(Endpoint&, Message&)> slot)
+{
+    // Slots are called with this lock held (see M_receiveThread())
+    std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+
+    if (slot)
+        m_slots[type_id] = std::move(slot);
+    else
+        m_slots.erase(type_id);
+}
+
+void Endpoint::setReceiveGate(std::function<bool()> gate)
+{
+    {
+        // The gate is checked with this lock held (see M_gateClosed())
+        std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+        m_receive_gate = std::move(gate);
+    }
+
+    // The messages declined by the previous gate may be taken now
+    notifyReceiveGate();
+}
+
+bool Endpoint::M_gateClosed(unsigned channel)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+
+    Endpoint* ep = m_shared->channel_eps[channel];
+    if (!ep || !ep->m_receive_gate)
+        return false;
+
+    // Before checking, so that a concurrent notifyReceiveGate() wakes us up
+    m_shared->gate_declined = true;
+
+    return !ep->m_receive_gate();
+}
+
+void Endpoint::notifyReceiveGate()
+{
+    if (!m_shared->gate_declined.exchange(false))
+        return;
+
+    // Wake up the receiving thread wherever it waits : for the gate if
+    //   workers may take the messages it declined, or for the doorbell
+    {
+        std::lock_guard<std::mutex> lock(m_shared->gate_mutex);
+        m_shared->gate_cond.notify_all();
+    }
+
+    m_shared->data->doorbells[m_shared->recv_dir].sem.post();
 }
 
 void Endpoint::registerExceptionHandler(std::function<void(core::RecoverableException const&)> const& handler)
@@ -193,50 +617,182 @@ void Endpoint::registerExceptionHandler(std::function<void(core::RecoverableExce
 
 void Endpoint::M_receiveThread()
 {
-    bool stop_thread = false;
-    do
+    SharedDoorbell& doorbell = m_shared->data->doorbells[m_shared->recv_dir];
+    unsigned channels = m_shared->data->channels;
+    unsigned next_channel = 0;
+
+    for (;;)
     {
-        // Wait until there is some data to receive, or if the thread
-        //   must terminate
-        m_shared->recv_buf->sem_full.wait();
-        m_shared->recv_buf->mutex.wait();
+        // Wait until there is some data to receive on any channel, or until
+        //   the poll period elapses if other receivers share the doorbell
+        //   (see the Worker constructor for the other side of server_waiting)
+        bool rung = true;
+
+        if (m_role == Server)
+            m_shared->data->server_waiting = true;
+
+        if (m_role == Client || (m_role == Server && !m_shared->data->workers))
+            doorbell.sem.wait();
+        else
+            rung = doorbell.sem.timed_wait(receiveDeadline());
+
+        if (m_role == Server)
+            m_shared->data->server_waiting = false;
 
-        // If asked for shutdown, terminate this thread
-        if (m_shared->recv_buf->shutdown)
+        // If asked to stop, terminate this thread. The wakeup we may have
+        //   taken could belong to a message, give it back for other receivers.
+        if (m_shared->stop)
         {
-            stop_thread = true;
+            if (rung)
+                doorbell.sem.post();
+            break;
         }
-        else
+
+        // Doorbell rings are posted after the buffers are filled, but the
+        //   message matching a ring may have been taken by another receiver
+        //   (or the ring may be a stop request for another receiver), so
+        //   there may be nothing to receive.
+        // Look for a message starting after the last served channel, so that
+        //   busy channels can't starve the others.
+        // Channels whose receive gate is closed are left alone, along with
+        //   their message (if any) for the other receivers.
+        bool received = false;
+        bool declined = false;
+
+        for (unsigned i = 0; i < channels; ++i)
+        {
+            unsigned channel = (next_channel + i) % channels;
+            SharedBuffer* recv_buf = m_shared->data->buffer(channel, m_shared->recv_dir);
+
+            if (!recv_buf->sem_full.try_wait())
+                continue;
+
+            if (M_gateClosed(channel))
+            {
+                recv_buf->sem_full.post();
+                declined = true;
+                continue;
+            }
+
+            recv_buf->mutex.wait();
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(m_shared->channels_mutex);
+
+                if (Endpoint* ep = m_shared->channel_eps[channel])
+                {
+                    ep->M_dispatch(recv_buf);
+                }
+                else
+                {
+                    M_releaseBuffer(recv_buf);
+
+                    try {
+                        LESF_CORE_THROW(DataFormatException, "IPC message received on channel " << channel << " which is not opened");
+                    } catch (core::RecoverableException const& exc) {
+                        if (m_exc_handler)
+                            (*m_exc_handler)(exc);
+                    }
+                }
+            }
+
+            next_channel = channel + 1;
+            received = true;
+            break;
+        }
+
+        // Spare the next notifications a wakeup
+        if (!declined)
+            m_shared->gate_declined = false;
+
+        // The ring we took may belong to a message we declined. Give it back
+        //   for the workers, and leave them some time to take it (the receive
+        //   gate being closed, we likely can't take much meanwhile). Without
+        //   workers, notifyReceiveGate() rings the doorbell again instead.
+        if (rung && declined && !received && (m_role == Worker || m_shared->data->workers))
         {
-            try {
-                Message* msg = 0;
-
-                // We must respect RAII when an exception is thrown so that msg
-                //   is properly deleted
-                struct deleter {
-                    deleter(Message** msg) : msg(msg) {}
-                    ~deleter() { if (*msg) delete *msg; }
-                    Message** msg;
-                } _deleter(&msg);
-
-                // Construct the message from JSON data and get the type identifier (this can throw)
-                std::string type_id;
-                msg = MessageFactory::construct(m_shared->recv_buf->buffer, &type_id);
-
-                // Call the appropriate slot
-                auto it = m_slots.find(type_id);
-                if (it == m_slots.end())
-                    LESF_CORE_THROW(DataFormatException, "IPC message type `" + type_id + "`is not connected to any slot");
-                
-                it->second(*this, *msg);
-            } catch (core::RecoverableException const& exc) {
-                if (m_exc_handler)
-                    (*m_exc_handler)(exc);
-            } // other exceptions will call std::terminate()
+            doorbell.sem.post();
+
+            std::unique_lock<std::mutex> lock(m_shared->gate_mutex);
+            m_shared->gate_cond.wait_for(lock, std::chrono::milliseconds(ReceivePollPeriodMs),
+                [this]() { return !m_shared->gate_declined || m_shared->stop; });
         }
+    }
+}
+
+void Endpoint::M_capture(Capture::Direction direction, unsigned channel, std::string const& type_id, const char* data, std::size_t size)
+{
+    // Sent frames have no type identifier when they must not be captured
+    if (direction == Capture::Sent && type_id.empty())
+        return;
+
+    if (Capture* capture = m_capture.load())
+        capture->record(direction, channel, type_id, data, size);
+}
 
-        // Signal that we consumed this data
-        m_shared->recv_buf->mutex.post();
-        m_shared->recv_buf->sem_empty.post();
-    } while (!stop_thread);
+void Endpoint::M_releaseBuffer(SharedBuffer* buf)
+{
+    // Signal that we consumed this data
+    buf->mutex.post();
+    buf->sem_empty.post();
+}
+
+void Endpoint::M_dispatch(SharedBuffer* buf)
+{
+    // Type identifier of the message, if it can be constructed
+    std::string type_id;
+
+    // Release the shared buffer as soon as we are done reading it, so that
+    //   senders are not blocked by slow slots (frames that can't be
+    //   constructed are captured as well, without type identifier)
+    struct releaser {
+        releaser(Endpoint* ep, SharedBuffer* buf, std::string const& type_id) : ep(ep), buf(buf), type_id(type_id), capture(true) {}
+        ~releaser() { release(); }
+        void release()
+        {
+            if (!buf)
+                return;
+            if (capture)
+                ep->M_capture(Capture::Received, ep->m_channel, type_id, buf->buffer, buf->size);
+            ep->M_releaseBuffer(buf);
+            buf = 0;
+        }
+        Endpoint* ep;
+        SharedBuffer* buf;
+        std::string const& type_id;
+        bool capture; // Not for frames carrying blobs
+    } _releaser(this, buf, type_id);
+
+    try {
+        Message* msg = 0;
+
+        // We must respect RAII when an exception is thrown so that msg
+        //   is properly deleted
+        struct deleter {
+            deleter(Message** msg) : msg(msg) {}
+            ~deleter() { if (*msg) delete *msg; }
+            Message** msg;
+        } _deleter(&msg);
+
+        // Blobs in the message refer to our arena
+        BlobArena::Scope blob_scope(m_blobs);
+
+        // Construct the message from JSON data and get the type identifier (this can throw)
+        // The data is parsed straight from the shared buffer, which is ours
+        //   until it is released.
+        msg = MessageFactory::construct(buf->buffer, buf->size, &type_id);
+        if (blob_scope.received())
+            _releaser.capture = false;
+        _releaser.release();
+
+        // Call the appropriate slot
+        auto it = m_slots.find(type_id);
+        if (it == m_slots.end())
+            LESF_CORE_THROW(DataFormatException, "IPC message type `" + type_id + "`is not connected to any slot");
+
+        it->second(*this, *msg);
+    } catch (core::RecoverableException const& exc) {
+        if (m_exc_handler)
+            (*m_exc_handler)(exc);
+    } // other exceptions will call std::terminate()
 }
@@ -18,19 +18,96 @@
 
 #include "lesf/ipc/message_factory.h"
 
+#include <streambuf>
+#include <istream>
+#include <ostream>
+#include <memory>
+
 using namespace lconf;
 
 using namespace lesf;
 using namespace ipc;
 
-std::map<std::string, std::string> MessageFactory::m_rtti_map;
-std::map<std::string, std::function<Message*(json::Node*)>> MessageFactory::m_ctors;
+// Raw frames (used for ipc::PodMessage<> types) start with a NUL byte, which can't
+//   start a JSON document. Their layout is :
+//     [marker (1)] [identifier size (1)] [layout hash (8)] [identifier] [value]
+static const char RawFrameMarker = '\0';
+static const std::size_t RawFrameHeaderSize = 10;
+
+std::map<std::type_index, std::string>& MessageFactory::M_rttiMap()
+{
+    static std::map<std::type_index, std::string> rtti_map;
+    return rtti_map;
+}
+
+std::map<std::string, std::function<Message*(json::Node*)>>& MessageFactory::M_ctors()
+{
+    static std::map<std::string, std::function<Message*(json::Node*)>> ctors;
+    return ctors;
+}
+
+std::map<std::string, MessageFactory::RawType>& MessageFactory::M_rawTypes()
+{
+    static std::map<std::string, RawType> raw_types;
+    return raw_types;
+}
+
+// Read-only stream buffer over a memory span that we do not own. This allows
+//   json::parse() to read its input in place instead of from a std::string copy.
+class SpanStreamBuf : public std::streambuf
+{
+public:
+    SpanStreamBuf(const char* data, std::size_t size)
+    {
+        // std::streambuf wants char*, but we never write through the get area
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+// Write-only stream buffer appending to a string, so that serialized frames
+//   are built in place rather than copied out of a std::ostringstream.
+class StringStreamBuf : public std::streambuf
+{
+public:
+    StringStreamBuf(std::string& str) :
+        m_str(str)
+    {}
+
+protected:
+    int_type overflow(int_type c)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            m_str.push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        m_str.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+
+private:
+    std::string& m_str;
+};
+
+// Most frames fit in this, which saves growing them while serializing
+static const std::size_t SerializedFrameReserve = 512;
 
 Message* MessageFactory::construct(std::string const& json, std::string* id)
 {
-    // Parse the JSON input
-    std::istringstream ss;
-    ss.str(json);
+    return construct(json.data(), json.size(), id);
+}
+
+Message* MessageFactory::construct(const char* data_ptr, std::size_t size, std::string* id)
+{
+    if (size && data_ptr[0] == RawFrameMarker)
+        return M_constructRaw(data_ptr, size, id);
+
+    // Parse the JSON input directly from the given span
+    SpanStreamBuf buf(data_ptr, size);
+    std::istream ss(&buf);
 
     json::Node* data;
     try {
@@ -53,8 +130,8 @@ Message* MessageFactory::construct(std::string const& json, std::string* id)
     }
 
     // Find the associated constructor
-    auto it = m_ctors.find(idStringNode->value());
-    if (it == m_ctors.end())
+    auto it = M_ctors().find(idStringNode->value());
+    if (it == M_ctors().end())
         LESF_CORE_THROW(DataFormatException, "unknown identifier `" << idStringNode->value() << "` in IPC JSON data");
 
     // If necessary, get the type identifier
@@ -73,26 +150,85 @@ Message* MessageFactory::construct(std::string const& json, std::string* id)
     return msg;
 }
 
+std::string const& MessageFactory::typeIdentifier(Message const& msg)
+{
+    auto it = M_rttiMap().find(std::type_index(typeid(msg)));
+
+    if (it == M_rttiMap().end())
+        LESF_CORE_THROW(TypeException, "type is not registered (RTTI name `" << typeid(msg).name() << "`)");
+
+    return it->second;
+}
+
 std::string MessageFactory::serialize(Message const& msg)
 {
-    // Check if the message type is registered in the system
-    auto rtti_id = typeid(msg).name();
-    if (m_rtti_map.find(rtti_id) == m_rtti_map.end())
-        LESF_CORE_THROW(TypeException, "type is not registered (RTTI name `" << rtti_id << "`)");
-    
-    // Get the associated IPC identifier
-    auto id = m_rtti_map[rtti_id];
-
-    // Create the JSON representation
-    json::Template tpl;
-    tpl.bind("id", id);
-    json::ObjectNode* data = tpl.synthetize()->downcast<json::ObjectNode>();
-    json::Node* payload_data = msg.M_push();
-    data->get("payload") = payload_data ? payload_data : new json::ObjectNode();
-
-    // Serialize it into plain text and return
-    std::ostringstream ss;
-    data->serialize(ss, false);
-    delete data;
-    return ss.str();
+    // Get the associated IPC identifier, if the message type is registered
+    std::string const& id = typeIdentifier(msg);
+
+    // Plain data messages are sent as a raw copy, tagged with their layout hash
+    if (auto pod = dynamic_cast<detail::PodMessageBase const*>(&msg))
+    {
+        if (id.size() > 0xFF)
+            LESF_CORE_THROW(TypeException, "identifier `" << id << "` is too long for a raw IPC frame");
+
+        std::uint64_t hash = pod->M_layoutHash();
+
+        std::string frame(RawFrameHeaderSize + id.size() + pod->M_rawSize(), RawFrameMarker);
+        frame[1] = static_cast<char>(id.size());
+        std::memcpy(&frame[2], &hash, sizeof(hash));
+        std::memcpy(&frame[RawFrameHeaderSize], id.data(), id.size());
+        std::memcpy(&frame[RawFrameHeaderSize + id.size()], pod->M_rawData(), pod->M_rawSize());
+        return frame;
+    }
+
+    // Serialize the JSON representation of the payload into plain text. The
+    //   envelope is written around it directly, as synthetizing it costs several
+    //   allocations per message (identifiers don't need any escaping).
+    std::unique_ptr<json::Node> payload_data(msg.M_push());
+
+    std::string frame;
+    frame.reserve(SerializedFrameReserve);
+
+    StringStreamBuf buf(frame);
+    std::ostream ss(&buf);
+
+    ss << "{\"id\":\"" << id << "\",\"payload\":";
+    if (payload_data)
+        payload_data->serialize(ss, false);
+    else
+        ss << "{}";
+    ss << '}';
+
+    return frame;
+}
+
+Message* MessageFactory::M_constructRaw(const char* data, std::size_t size, std::string* id)
+{
+    // Check the frame header
+    if (size < RawFrameHeaderSize || size < RawFrameHeaderSize + static_cast<unsigned char>(data[1]))
+        LESF_CORE_THROW(DataFormatException, "invalid IPC raw frame (truncated header)");
+
+    std::string type_id(data + RawFrameHeaderSize, static_cast<unsigned char>(data[1]));
+    std::uint64_t hash;
+    std::memcpy(&hash, data + 2, sizeof(hash));
+
+    // Find the associated type
+    auto it = M_rawTypes().find(type_id);
+    if (it == M_rawTypes().end())
+        LESF_CORE_THROW(DataFormatException, "unknown identifier `" << type_id << "` in IPC raw frame");
+
+    // Make sure both sides agree on the memory layout before copying anything
+    if (hash != it->second.layout_hash)
+        LESF_CORE_THROW(TypeException, "layout mismatch for IPC type `" << type_id << "` (received hash " << std::hex << hash
+                        << ", expected " << it->second.layout_hash << "), peer was built with another definition");
+
+    std::size_t payload_size = size - RawFrameHeaderSize - type_id.size();
+    if (payload_size != it->second.size)
+        LESF_CORE_THROW(TypeException, "size mismatch for IPC type `" << type_id << "` (received " << payload_size
+                        << " bytes, expected " << it->second.size << ")");
+
+    if (id)
+        *id = type_id;
+
+    return it->second.ctor(data + RawFrameHeaderSize + type_id.size());
 }
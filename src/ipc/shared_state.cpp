@@ -0,0 +1,284 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lesf/ipc/shared_state.h"
+#include "lesf/ipc/exception.h"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+using namespace boost::interprocess;
+
+using namespace lesf;
+using namespace ipc;
+using namespace detail;
+
+// This is the actual data shared between the writer and the readers. It is
+//   followed in the shared memory by the value itself.
+struct SharedStateHeader
+{
+    SharedStateHeader(std::uint64_t layout_hash, std::size_t size) :
+        sequence(0),
+        layout_hash(layout_hash),
+        size(size),
+        generation(0)
+    {}
+
+    // Offset of the value from the start of the shared memory
+    static std::size_t dataOffset()
+    {
+        return (sizeof(SharedStateHeader) + SharedStateBase::MaxAlignment - 1) / SharedStateBase::MaxAlignment * SharedStateBase::MaxAlignment;
+    }
+
+    char* data()
+    {
+        return reinterpret_cast<char*>(this) + dataOffset();
+    }
+
+    std::atomic<std::uint64_t> sequence; // Odd while a write is in progress
+    std::uint64_t layout_hash; // Checked by readers, see ipc::PodMessage<>
+    std::size_t size; // Size of the value
+
+    interprocess_mutex mutex; // Protect generation
+    interprocess_condition changed; // Notified by the writer after each write
+    std::uint64_t generation; // Incremented after each write
+};
+
+class SharedStateBase::Internals
+{
+public:
+    Internals() :
+        shm(0),
+        map(0),
+        header(0),
+        stop(false)
+    {}
+
+    shared_memory_object* shm; // Shared memory descriptor
+    mapped_region* map; // Memory map to access shared memory
+    SharedStateHeader* header; // Actual shared data structure in the map
+
+    std::mutex handlers_mutex; // Protect handlers
+    std::vector<std::function<void()>> handlers; // Subscribed handlers
+    std::thread notify_thread; // Calls handlers after each write, started on first subscription
+    bool stop; // This flag is used to stop the notification thread, protected by header->mutex
+};
+
+SharedStateBase::SharedStateBase(Role role, std::string const& name, std::size_t size, std::uint64_t layout_hash, const void* initial) :
+    m_role(role),
+    m_name(name),
+    m_size(size),
+    m_internals(new Internals())
+{
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ipc::SharedState<> needs lock-free 64-bit atomics to be used across processes");
+
+    if (role == Writer)
+    {
+        // Normally not required, but we do it anyway to avoid problems if the
+        //   program crashed and didn't remove the resource from the system
+        shared_memory_object::remove(name.c_str());
+
+        try {
+            // Create the shared memory region
+            m_internals->shm = new shared_memory_object(create_only, name.c_str(), read_write);
+            m_internals->shm->truncate(SharedStateHeader::dataOffset() + size);
+            m_internals->map = new mapped_region(*m_internals->shm, read_write);
+
+            // Construct our shared memory space, with the initial value
+            m_internals->header = new (m_internals->map->get_address()) SharedStateHeader(layout_hash, size);
+            std::memcpy(m_internals->header->data(), initial, size);
+
+        } catch (interprocess_exception const& exc) {
+            delete m_internals->map;
+            delete m_internals->shm;
+            delete m_internals;
+
+            LESF_CORE_THROW(SharedMemoryException, "unable to create IPC shared state `" << name << "` : " << exc.what());
+        }
+    }
+    else
+    {
+        try {
+            // Open the shared memory region created by the writer
+            m_internals->shm = new shared_memory_object(open_only, name.c_str(), read_write);
+            m_internals->map = new mapped_region(*m_internals->shm, read_write);
+            m_internals->header = static_cast<SharedStateHeader*>(m_internals->map->get_address());
+
+        } catch (interprocess_exception const& exc) {
+            delete m_internals->map;
+            delete m_internals->shm;
+            delete m_internals;
+
+            LESF_CORE_THROW(SharedMemoryException, "unable to open IPC shared state `" << name << "` : " << exc.what());
+        }
+
+        // Make sure both sides agree on the memory layout before reading anything
+        SharedStateHeader* header = m_internals->header;
+        if (m_internals->map->get_size() < SharedStateHeader::dataOffset() + size ||
+            header->layout_hash != layout_hash || header->size != size)
+        {
+            std::uint64_t header_hash = header->layout_hash;
+
+            delete m_internals->map;
+            delete m_internals->shm;
+            delete m_internals;
+
+            LESF_CORE_THROW(TypeException, "layout mismatch for IPC shared state `" << name << "` (hash " << std::hex << header_hash
+                            << ", expected " << layout_hash << "), writer was built with another definition");
+        }
+    }
+}
+
+SharedStateBase::~SharedStateBase()
+{
+    // Stop the notification thread, if any
+    if (m_internals->notify_thread.joinable())
+    {
+        {
+            scoped_lock<interprocess_mutex> lock(m_internals->header->mutex);
+            m_internals->stop = true;
+            m_internals->header->changed.notify_all();
+        }
+
+        m_internals->notify_thread.join();
+    }
+
+    // The header is not destroyed : readers may still be waiting on its
+    //   condition (which would block its destruction), and the memory goes
+    //   away with the last mapping anyway.
+
+    // Delete shared memory descriptors
+    delete m_internals->map;
+    delete m_internals->shm;
+
+    // make sure to remove the shared memory resource from the system
+    if (m_role == Writer)
+        shared_memory_object::remove(m_name.c_str());
+
+    delete m_internals;
+}
+
+SharedStateBase::Role SharedStateBase::role() const
+{
+    return m_role;
+}
+
+std::string const& SharedStateBase::name() const
+{
+    return m_name;
+}
+
+std::uint64_t SharedStateBase::version() const
+{
+    return m_internals->header->sequence.load(std::memory_order_acquire) / 2;
+}
+
+void SharedStateBase::M_write(const void* value)
+{
+    if (m_role != Writer)
+        LESF_CORE_THROW(SharedMemoryException, "IPC shared state `" << m_name << "` can only be written by its writer");
+
+    SharedStateHeader* header = m_internals->header;
+
+    // Make the sequence odd while writing, so that readers retry. There is a
+    //   single writer, so no need for a read-modify-write.
+    std::uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+    header->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::memcpy(header->data(), value, m_size);
+
+    header->sequence.store(sequence + 2, std::memory_order_release);
+
+    // Wake subscribers up
+    scoped_lock<interprocess_mutex> lock(header->mutex);
+    ++header->generation;
+    header->changed.notify_all();
+}
+
+void SharedStateBase::M_read(void* value) const
+{
+    SharedStateHeader* header = m_internals->header;
+
+    for (;;)
+    {
+        std::uint64_t sequence = header->sequence.load(std::memory_order_acquire);
+
+        // A write is in progress
+        if (sequence & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::memcpy(value, header->data(), m_size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // Keep the copy only if no write started meanwhile
+        if (header->sequence.load(std::memory_order_relaxed) == sequence)
+            return;
+    }
+}
+
+void SharedStateBase::M_subscribe(std::function<void()> const& handler)
+{
+    std::lock_guard<std::mutex> lock(m_internals->handlers_mutex);
+    m_internals->handlers.push_back(handler);
+
+    if (m_internals->notify_thread.joinable())
+        return;
+
+    std::uint64_t generation;
+    {
+        scoped_lock<interprocess_mutex> lock(m_internals->header->mutex);
+        generation = m_internals->header->generation;
+    }
+
+    m_internals->notify_thread = std::thread([this, generation]()
+    {
+        SharedStateHeader* header = m_internals->header;
+        std::uint64_t seen = generation;
+
+        for (;;)
+        {
+            // Wait until the value changes, or until we are destroyed
+            {
+                scoped_lock<interprocess_mutex> lock(header->mutex);
+                while (!m_internals->stop && header->generation == seen)
+                    header->changed.wait(lock);
+
+                if (m_internals->stop)
+                    break;
+
+                seen = header->generation;
+            }
+
+            std::lock_guard<std::mutex> lock(m_internals->handlers_mutex);
+            for (auto const& handler : m_internals->handlers)
+                handler();
+        }
+    });
+}
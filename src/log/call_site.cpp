@@ -0,0 +1,152 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "lesf/log/call_site.h"
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+using namespace lesf;
+using namespace log;
+
+// See CallSite::setEnabled()
+struct Rule
+{
+    bool enabled;
+    Message::Type level;
+    std::string file;
+    std::string function;
+
+    bool matches(CallSite const& site) const
+    {
+        if (site.type < level)
+            return false;
+
+        std::size_t length = std::strlen(site.file);
+        if (file.size() > length || file.compare(0, file.size(), site.file + length - file.size()))
+            return false;
+
+        return function.empty() || function == site.function;
+    }
+
+    // Whether this rule matches all the call sites the other one does
+    bool covers(Rule const& other) const
+    {
+        if (other.level < level)
+            return false;
+
+        if (file.size() > other.file.size() ||
+            other.file.compare(other.file.size() - file.size(), file.size(), file))
+            return false;
+
+        return function.empty() || function == other.function;
+    }
+};
+
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<CallSite const*> sites; // Indexed by their identifier minus one
+    std::vector<Rule> rules;
+};
+
+// Call sites may be used from any static initializer or destructor, such as
+//   the ones of the logger, so the registry is created on first use and
+//   never destroyed
+static Registry& registry()
+{
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+unsigned CallSite::id() const
+{
+    unsigned id = registered_id.load(std::memory_order_acquire);
+    if (id)
+        return id;
+
+    M_register();
+    return registered_id.load(std::memory_order_acquire);
+}
+
+bool CallSite::M_register() const
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    // Someone may have registered it meanwhile
+    if (!registered_id.load(std::memory_order_relaxed))
+    {
+        bool enabled = true;
+        for (Rule const& rule : reg.rules)
+        {
+            if (rule.matches(*this))
+                enabled = rule.enabled;
+        }
+
+        reg.sites.push_back(this);
+        state.store(enabled ? Enabled : Disabled, std::memory_order_relaxed);
+        registered_id.store(reg.sites.size(), std::memory_order_release);
+    }
+
+    return state.load(std::memory_order_relaxed) == Enabled;
+}
+
+void CallSite::setEnabled(bool enabled, Message::Type level, std::string const& file, std::string const& function)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    Rule rule{ enabled, level, file, function };
+
+    // Forget the rules this one overrides, so that toggling the same rule
+    //   repeatedly doesn't make the list (and registrations) grow
+    reg.rules.erase(std::remove_if(reg.rules.begin(), reg.rules.end(),
+                                   [&](Rule const& other) { return rule.covers(other); }),
+                    reg.rules.end());
+
+    // Enabling all the call sites overrides every rule, that's the default
+    if (!enabled || !rule.covers(Rule{ true, Message::Crash, "", "" }))
+        reg.rules.push_back(rule);
+
+    for (CallSite const* site : reg.sites)
+    {
+        if (rule.matches(*site))
+            site->state.store(enabled ? Enabled : Disabled, std::memory_order_relaxed);
+    }
+}
+
+Message::BuildInfo CallSite::buildInfo() const
+{
+    return Message::BuildInfo{ file, line, function, build_date, build_time,
+                               user_build_id, user_program, user_version };
+}
+
+CallSite const* CallSite::find(unsigned id)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    if (!id || id > reg.sites.size())
+        return 0;
+
+    return reg.sites[id - 1];
+}
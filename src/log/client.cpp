@@ -18,6 +18,7 @@
 
 #include "lesf/log/client.h"
 #include "lesf/log/session.h"
+#include "lesf/log/call_site.h"
 
 #include <thread>
 #include <sstream>
@@ -37,21 +38,37 @@ class Client::Internals
 public:
     Internals() :
         ctx(),
-        socket(ctx)
+        socket(ctx),
+        linger_timer(ctx)
     {}
 
 public:
     io_context ctx;
     tcp::socket socket;
+    steady_timer linger_timer;
     std::thread io_thread;
 };
 
-Client::Client(unsigned short port, std::string const& server) :
+Client::Client(unsigned short port, std::string const& server, unsigned linger) :
     m_port(port),
     m_server(server),
+    m_linger(linger),
     m_internals(new Client::Internals()),
     m_connected(false),
-    m_terminate(false)
+    m_terminate(false),
+    m_queued_bytes(0),
+    m_max_queued_bytes(Config::ClientQueueSize),
+    m_queue_policy(DropOldest),
+    m_drop_level(Message::Warning),
+    m_dropped(),
+    m_oversized(0),
+    m_dropped_process(),
+    m_hello_pending(false),
+    m_switch_pending(false),
+    m_binary(false),
+    m_writing(false),
+    m_lingering(false),
+    m_write_count(0)
 {
     M_doConnect();
     m_internals->io_thread = std::thread(&Client::M_ioThread, this);
@@ -69,15 +86,21 @@ Client::~Client()
     delete m_internals;
 }
 
-void Client::send(std::string const& msg)
+void Client::send(Message const& msg)
 {
-    // Add the header to the message
-    char header[Session::HeaderSize+1];
-    sprintf(header, "%0*lu", Session::HeaderSize, msg.size());
-    std::string msg_with_header = std::string(header) + msg;
-
     // Schedule the message for sending
-    M_queueMessage(msg_with_header);
+    M_queueMessage(msg);
+}
+
+void Client::setQueueLimit(std::size_t max_bytes, QueuePolicy policy, Message::Type level)
+{
+    post(m_internals->ctx,
+        [this, max_bytes, policy, level]()
+        {
+            m_max_queued_bytes = max_bytes;
+            m_queue_policy = policy;
+            m_drop_level = level;
+        });
 }
 
 // This thread runs the boost::asio::io_context object's event loop.
@@ -118,11 +141,17 @@ void Client::M_doConnect()
                 m_internals->socket.set_option(tcp::no_delay(true));
 
                 m_connected = true;
+
+                // A new session knows none of our call sites, and speaks JSON
+                m_sent_call_sites.clear();
+                m_hello_pending = true;
+                m_switch_pending = false;
+                m_binary = false;
+
                 M_doRead(); // To monitor socket status
 
-                // Send any queued messages
-                if (!m_message_queue.empty())
-                    M_doWrite();
+                // Propose the binary protocol, and send any queued messages
+                M_doWrite();
             }
             else
             {
@@ -135,8 +164,9 @@ void Client::M_doConnect()
         });
 }
 
-// We use an async read just to monitor socket status, otherwise if the connection is closed
+// We use an async read to monitor socket status, otherwise if the connection is closed
 //   by the peer, the first write will not return any error code and we lose a message.
+// The only thing the server sends is its answer to our protocol proposal.
 void Client::M_doRead()
 {
     async_read(m_internals->socket, buffer(m_dummy),
@@ -144,6 +174,13 @@ void Client::M_doRead()
         {
             if (!err)
             {
+                if (m_dummy[0] == Session::ProtocolVersion && !m_binary)
+                {
+                    m_switch_pending = true;
+                    if (!m_writing)
+                        M_doWrite();
+                }
+
                 // If we read something, monitor again
                 if (!m_terminate)
                     M_doRead();
@@ -157,35 +194,228 @@ void Client::M_doRead()
         });
 }
 
-void Client::M_queueMessage(std::string message_with_header)
+void Client::M_queueMessage(Message const& msg)
 {
     post(m_internals->ctx,
-        [this, message_with_header]()
+        [this, msg]() mutable
         {
-            // Put the message in the outgoing queue
-            bool write_in_progress = !m_message_queue.empty();
-            m_message_queue.push_back(message_with_header);
+            // Put the message in the outgoing queue, if there's room for it
+            std::size_t size = M_queuedSize(msg);
+            if (!M_makeRoom(msg, size))
+            {
+                M_dropped(msg);
+                return;
+            }
+
+            m_message_queue.push_back(std::move(msg));
+            m_queued_bytes += size;
 
             // If we're conected and not already in a M_doWrite event loop,
-            //   try to send the message
-            if (m_connected && !write_in_progress)
+            //   try to send the message (maybe along with the next ones)
+            if (m_connected && !m_writing)
+            {
+                if (!m_linger || m_message_queue.size() >= MaxWriteCount)
+                    M_doWrite();
+                else if (!m_lingering)
+                    M_doLinger();
+            }
+        });
+}
+
+bool Client::M_makeRoom(Message const& msg, std::size_t size)
+{
+    if (m_queued_bytes + size <= m_max_queued_bytes)
+        return true;
+
+    if (m_queue_policy == DropNewest || (m_queue_policy == DropLessSevere && msg.type() > m_drop_level))
+        return false;
+
+    // Evict the oldest messages, but not the ones being written
+    std::size_t first = m_writing ? m_write_count : 0;
+
+    while (m_queued_bytes + size > m_max_queued_bytes && m_message_queue.size() > first)
+    {
+        auto it = m_message_queue.begin() + first;
+
+        M_dropped(*it);
+        m_queued_bytes -= M_queuedSize(*it);
+        m_message_queue.erase(it);
+    }
+
+    return true;
+}
+
+void Client::M_dropped(Message const& msg)
+{
+    ++m_dropped[msg.type()];
+    m_dropped_process = msg.processInfo();
+}
+
+void Client::M_oversized(Message const& msg)
+{
+    ++m_oversized;
+    m_dropped_process = msg.processInfo();
+}
+
+void Client::M_queueDropReport()
+{
+    if (m_dropped.empty() && !m_oversized)
+        return;
+
+    static const std::map<Message::Type, const char*> type_names =
+    {
+        { Message::Unknown, "unknown" },
+        { Message::Crash, "crash" },
+        { Message::Error, "error" },
+        { Message::Warning, "warning" },
+        { Message::Info, "info" },
+        { Message::Trace, "trace" }
+    };
+
+    std::size_t total = 0;
+    std::ostringstream details;
+
+    for (auto const& it : m_dropped)
+    {
+        total += it.second;
+        details << (details.tellp() ? ", " : "") << it.second << " " << type_names.at(it.first);
+    }
+
+    std::ostringstream ss;
+    if (total)
+        ss << total << " log messages dropped because the client queue was full (" << details.str() << ")";
+    if (m_oversized)
+        ss << (total ? ", " : "") << m_oversized << " log messages dropped because they were too big to be sent";
+
+    Message report(Message::Warning,
+        { __FILE__, __LINE__, __FUNCTION__, __DATE__, __TIME__,
+          LESF_USER_BUILD_ID, LESF_USER_PROGRAM, LESF_USER_VERSION },
+        Message::ProcessInfo(m_dropped_process), ss.str());
+
+    // Sent before anything else, even if that overflows the queue a bit
+    m_queued_bytes += M_queuedSize(report);
+    m_message_queue.push_front(std::move(report));
+    m_dropped.clear();
+    m_oversized = 0;
+}
+
+std::size_t Client::M_queuedSize(Message const& msg)
+{
+    std::size_t size = sizeof(Message) + msg.message().size() + msg.processInfo().process.size();
+
+    // Messages from a call site don't hold their build info
+    if (!msg.callSite())
+    {
+        Message::BuildInfo build_info = msg.buildInfo();
+        size += build_info.file.size() + build_info.function.size() + build_info.build_date.size() +
+                build_info.build_time.size() + build_info.user_build_id.size() +
+                build_info.user_program.size() + build_info.user_version.size();
+    }
+
+    if (Message::ExceptionInfoPtr const& exc = msg.exceptionInfo())
+    {
+        size += sizeof(Message::ExceptionInfo) + exc->what.size() + exc->rtti_type.size() + exc->trace.size() +
+                exc->build_info.file.size() + exc->build_info.function.size() +
+                exc->build_info.build_date.size() + exc->build_info.build_time.size() +
+                exc->build_info.user_build_id.size() + exc->build_info.user_program.size() +
+                exc->build_info.user_version.size();
+    }
+
+    return size;
+}
+
+void Client::M_doLinger()
+{
+    m_lingering = true;
+    m_internals->linger_timer.expires_after(std::chrono::milliseconds(m_linger));
+    m_internals->linger_timer.async_wait(
+        [this](error_code const& err)
+        {
+            // Cancelled by M_doWrite()
+            if (err)
+                return;
+
+            m_lingering = false;
+            if (m_connected && !m_writing)
                 M_doWrite();
         });
 }
 
 void Client::M_doWrite()
 {
-    async_write(m_internals->socket, buffer(m_message_queue.front()),
+    if (m_lingering)
+    {
+        m_lingering = false;
+        m_internals->linger_timer.cancel();
+    }
+
+    m_write_buffer.clear();
+    m_write_count = 0;
+
+    // The connection works (again), report what we had to drop
+    M_queueDropReport();
+
+    if (m_hello_pending)
+    {
+        M_appendFrame(Session::HelloFrame, std::to_string(Session::ProtocolVersion));
+        m_hello_pending = false;
+    }
+
+    if (m_switch_pending)
+    {
+        M_appendFrame(Session::BinaryFrame, std::string());
+        m_switch_pending = false;
+        m_binary = true;
+    }
+
+    // Gather as many queued messages as reasonable in a single write
+    while (m_write_count < m_message_queue.size() && m_write_count < MaxWriteCount &&
+           m_write_buffer.size() < MaxWriteSize)
+    {
+        Message const& msg = m_message_queue[m_write_count];
+
+        // Send the call site of the message first, if this session doesn't know it yet
+        unsigned call_site = msg.callSite();
+        if (call_site && m_sent_call_sites.insert(call_site).second)
+        {
+            if (CallSite const* site = CallSite::find(call_site))
+                M_appendFrame(Session::CallSiteFrame, m_binary ?
+                    Message::serializeCallSiteBinary(*site) : Message::serializeCallSite(*site));
+        }
+
+        std::string data = m_binary ? Message::serializeBinary(msg) : Message::serializeCompact(msg);
+
+        // The session would close on it, and we would send it again and again
+        if (data.size() > Session::MaxFrameSize)
+        {
+            M_oversized(msg);
+            m_queued_bytes -= M_queuedSize(msg);
+            m_message_queue.erase(m_message_queue.begin() + m_write_count);
+            continue;
+        }
+
+        M_appendFrame(Session::MessageFrame, data);
+        ++m_write_count;
+    }
+
+    m_writing = !m_write_buffer.empty();
+    if (!m_writing)
+        return;
+
+    async_write(m_internals->socket, buffer(m_write_buffer),
         [this](error_code const& err, std::size_t)
         {
+            m_writing = false;
+
             if (!err)
             {
-                // Pop the message from the outgoing queue
-                m_message_queue.pop_front();
+                // Pop the written messages from the outgoing queue
+                for (std::size_t i = 0; i < m_write_count; ++i)
+                    m_queued_bytes -= M_queuedSize(m_message_queue[i]);
+                m_message_queue.erase(m_message_queue.begin(), m_message_queue.begin() + m_write_count);
 
-                // If there's still some messages to send, try to do so
-                if (!m_message_queue.empty())
-                    M_doWrite();
+                // If there's still something to send, try to do so
+                M_doWrite();
             }
             else
             {
@@ -197,3 +427,28 @@ void Client::M_doWrite()
             }
         });
 }
+
+void Client::M_appendFrame(char kind, std::string const& data)
+{
+    if (m_binary)
+    {
+        // Little endian size, then kind
+        for (std::size_t i = 0; i < 4; ++i)
+            m_write_buffer.push_back(static_cast<char>((data.size() >> (8 * i)) & 0xFF));
+        m_write_buffer.push_back(kind);
+    }
+    else
+    {
+        // Decimal size, prefixed with the kind for anything but messages
+        char header[Session::HeaderSize+1];
+
+        if (kind == Session::MessageFrame)
+            sprintf(header, "%0*lu", Session::HeaderSize, data.size());
+        else
+            sprintf(header, "%c%0*lu", kind, Session::HeaderSize - 1, data.size());
+
+        m_write_buffer.append(header, Session::HeaderSize);
+    }
+
+    m_write_buffer.append(data);
+}
@@ -0,0 +1,62 @@
+/* This file is part of libesf.
+ * 
+ * Copyright (c) 2019, Alexandre Monti
+ * 
+ * libesf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libesf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with libesf.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "lesf/log/deferred.h"
+
+#include <sstream>
+
+using namespace lesf;
+using namespace log;
+
+DeferredArgs::DeferredArgs(DeferredArgs&& other) :
+    m_ops(other.m_ops)
+{
+    if (m_ops)
+    {
+        m_ops->move(&m_storage, &other.m_storage);
+        m_ops->destroy(&other.m_storage);
+        other.m_ops = 0;
+    }
+}
+
+DeferredArgs::~DeferredArgs()
+{
+    if (m_ops)
+        m_ops->destroy(&m_storage);
+}
+
+std::string DeferredArgs::render(const char* format) const
+{
+    std::ostringstream ss;
+
+    if (m_ops)
+        m_ops->render(ss, format, &m_storage);
+
+    return ss.str();
+}
+
+const char* DeferredArgs::M_renderLiteral(std::ostream& os, const char* format)
+{
+    const char* it = format;
+    while (*it && !(it[0] == '{' && it[1] == '}'))
+        ++it;
+
+    os.write(format, it - format);
+    return it;
+}
@@ -64,8 +64,9 @@ void plain_light::operator()(Message const& msg)
     M_os() << time_str << " | ";
 
     // Software
-    M_os() << std::setw(8) << std::left << msg.buildInfo().user_program << " <";
-    M_os() << msg.buildInfo().user_build_id << "> | ";
+    log::Message::BuildInfo build_info = msg.buildInfo();
+    M_os() << std::setw(8) << std::left << build_info.user_program << " <";
+    M_os() << build_info.user_build_id << "> | ";
 
     // Process information
     M_os() << std::setw(8) << std::left << msg.processInfo().process << " (";
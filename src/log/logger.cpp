@@ -22,10 +22,321 @@
 #include <cstdlib>
 #include <fstream>
 #include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <type_traits>
 
 using namespace lesf;
 using namespace log;
 
+// A queued log message, complete or still to be formatted
+class LogEntry
+{
+public:
+    LogEntry(Message&& msg) :
+        site(0)
+    {
+        new (&message) Message(std::move(msg));
+    }
+
+    LogEntry(CallSite const& call_site, DeferredArgs&& deferred_args,
+             std::chrono::system_clock::time_point const& deferred_time) :
+        site(&call_site),
+        time(deferred_time)
+    {
+        new (&args) DeferredArgs(std::move(deferred_args));
+    }
+
+    ~LogEntry()
+    {
+        if (site)
+            args.~DeferredArgs();
+        else
+            message.~Message();
+    }
+
+    Message::Type type() const
+    {
+        return site ? site->type : message.type();
+    }
+
+    // Format a deferred entry
+    Message render() const
+    {
+        return Message(*site, Logger::getProcessInfo(), args.render(site->format), time);
+    }
+
+public:
+    CallSite const* site; // Null for complete messages
+    std::chrono::system_clock::time_point time;
+
+    union
+    {
+        Message message;
+        DeferredArgs args;
+    };
+};
+
+// A queue of messages with a single producer (the logging thread owning it)
+//   and a single consumer (the background thread of the asynchronous logger),
+//   both wait-free.
+class LogRing
+{
+public:
+    LogRing(std::size_t capacity) :
+        busy(false),
+        orphaned(false),
+        m_mask(capacity - 1),
+        m_slots(new Slot[capacity]),
+        m_head(0),
+        m_tail(0)
+    {}
+
+    ~LogRing()
+    {
+        while (pop([](LogEntry const&) {}));
+        delete[] m_slots;
+    }
+
+    // Returns false (leaving args untouched) if full, or the position of the
+    //   entry otherwise (see consumed())
+    template <typename... Args>
+    bool push(std::size_t& position, Args&&... args)
+    {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+            return false;
+
+        new (&m_slots[tail & m_mask]) LogEntry(std::forward<Args>(args)...);
+        m_tail.store(tail + 1, std::memory_order_release);
+        position = tail;
+        return true;
+    }
+
+    template <typename F>
+    bool pop(F f)
+    {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+
+        LogEntry* entry = reinterpret_cast<LogEntry*>(&m_slots[head & m_mask]);
+        f(*entry);
+        entry->~LogEntry();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool consumed(std::size_t position) const
+    {
+        return m_head.load(std::memory_order_acquire) > position;
+    }
+
+    std::size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+public:
+    std::atomic<bool> busy; // Set by the owner while queueing, see Logger::stopAsync()
+    std::atomic<bool> orphaned; // The owner thread exited, the ring can be deleted once empty
+
+private:
+    typedef std::aligned_storage<sizeof(LogEntry), alignof(LogEntry)>::type Slot;
+
+    std::size_t m_mask;
+    Slot* m_slots;
+
+    // Written by different threads, keep them on separate cache lines
+    char m_pad0[64];
+    std::atomic<std::size_t> m_head;
+    char m_pad1[64];
+    std::atomic<std::size_t> m_tail;
+    char m_pad2[64];
+};
+
+// The ring of the calling thread, given up when it exits
+struct LogRingOwner
+{
+    ~LogRingOwner()
+    {
+        if (ring)
+            ring->orphaned.store(true, std::memory_order_release);
+    }
+
+    LogRing* ring;
+};
+
+static thread_local LogRingOwner t_ring = { 0 };
+
+// Serializes startAsync() and stopAsync()
+static std::mutex async_control_mutex;
+
+class Logger::Async
+{
+public:
+    Async() :
+        capacity(0),
+        policy(Logger::Block),
+        dropped(0),
+        stop(false)
+    {}
+
+    ~Async()
+    {
+        for (LogRing* ring : rings)
+            delete ring;
+    }
+
+    // Send the queued messages, returns how many were sent
+    std::size_t drain()
+    {
+        std::size_t count = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto it = rings.begin(); it != rings.end();)
+        {
+            // Checked first, so that whatever was queued before is sent
+            bool orphaned = (*it)->orphaned.load(std::memory_order_acquire);
+
+            while ((*it)->pop(&Async::send))
+                ++count;
+
+            if (orphaned)
+            {
+                delete *it;
+                it = rings.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        if (std::uint64_t lost = dropped.exchange(0, std::memory_order_relaxed))
+        {
+            std::ostringstream ss;
+            ss << lost << " log messages dropped because of full buffers";
+
+            Logger::M_send(Message(Message::Warning,
+                { __FILE__, __LINE__, __FUNCTION__, __DATE__, __TIME__,
+                  LESF_USER_BUILD_ID, LESF_USER_PROGRAM, LESF_USER_VERSION },
+                Logger::getProcessInfo(), ss.str()));
+            ++count;
+        }
+
+        return count;
+    }
+
+    // Queue an entry built from args into the ring of the calling thread,
+    //   returns false if it must be logged synchronously instead
+    template <typename... Args>
+    bool queue(Message::Type type, Args&&... args) noexcept
+    {
+        try {
+            LogRing* ring = t_ring.ring;
+
+            // Give up a ring created before a restart with another capacity,
+            //   the background thread deletes it (it was emptied by stopAsync())
+            if (ring && ring->capacity() != capacity.load(std::memory_order_relaxed))
+            {
+                ring->orphaned.store(true, std::memory_order_release);
+                ring = 0;
+            }
+
+            if (!ring)
+            {
+                ring = new LogRing(capacity.load(std::memory_order_relaxed));
+
+                std::lock_guard<std::mutex> lock(mutex);
+                rings.push_back(ring);
+                t_ring.ring = ring;
+            }
+
+            // Checked again once busy, see stopAsync()
+            ring->busy = true;
+            if (!Logger::m_async_enabled)
+            {
+                ring->busy.store(false, std::memory_order_release);
+                return false;
+            }
+
+            std::size_t position;
+
+            while (!ring->push(position, std::forward<Args>(args)...))
+            {
+                OverflowPolicy current_policy = policy.load(std::memory_order_relaxed);
+
+                // Crash messages are never dropped, the program is likely to stop right after
+                if (current_policy == Logger::Block || type == Message::Crash)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                if (current_policy == Logger::CountAndDrop)
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+
+                ring->busy.store(false, std::memory_order_release);
+                return true;
+            }
+
+            ring->busy.store(false, std::memory_order_release);
+
+            // The program is likely to stop right after a crash, make sure it's sent
+            if (type == Message::Crash)
+            {
+                while (!ring->consumed(position))
+                    std::this_thread::yield();
+            }
+
+            return true;
+        } catch (std::exception const&) {
+            // Unable to create the ring, log synchronously
+            return false;
+        }
+    }
+
+    // Format the entry if needed, and send it
+    static void send(LogEntry const& entry) noexcept
+    {
+        if (!entry.site)
+        {
+            Logger::M_send(entry.message);
+            return;
+        }
+
+        try {
+            Logger::M_send(entry.render());
+        } catch (std::exception const& exc) {
+            Logger::log(exc, "deferred", entry.site->format);
+        }
+    }
+
+    void run()
+    {
+        while (!stop.load(std::memory_order_acquire))
+        {
+            if (!drain())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        drain();
+    }
+
+public:
+    std::mutex mutex; // Protect rings
+    std::vector<LogRing*> rings;
+
+    // Set while asynchronous logging is disabled, but a thread that saw it
+    //   enabled may still read them
+    std::atomic<std::size_t> capacity;
+    std::atomic<OverflowPolicy> policy;
+    std::atomic<std::uint64_t> dropped;
+    std::atomic<bool> stop;
+    std::thread thread;
+};
+
 class Logger::AutoDeleter
 {
 public:
@@ -38,18 +349,21 @@ public:
 
 Logger* Logger::m_inst = 0;
 std::mutex Logger::m_mutex;
+std::atomic<bool> Logger::m_async_enabled(false);
+Logger::Async* Logger::m_async = 0;
 
 
 static Logger::AutoDeleter m_inst_autodelete;
 
-void Logger::init(int argc, char** argv, unsigned short port, const char* fallback_log_file_prefix) noexcept
+void Logger::init(int argc, char** argv, unsigned short port, const char* fallback_log_file_prefix,
+                  unsigned linger) noexcept
 {
     std::lock_guard<std::mutex> lock(Logger::m_mutex);
 
     m_inst = new Logger(argc, argv, port, fallback_log_file_prefix);
 
     try {
-        m_inst->m_remote = new Client(port);
+        m_inst->m_remote = new Client(port, "localhost", linger);
     } catch (std::exception const& exc) {
         m_inst->m_fallback << "Failed to create remote client due to active exception ("
                            << typeid(exc).name() << "): " << exc.what() << std::endl
@@ -61,6 +375,100 @@ void Logger::init(int argc, char** argv, unsigned short port, const char* fallba
 }
 
 void Logger::log(Message const& msg) noexcept
+{
+    // Copied only if queued
+    if (m_async_enabled.load(std::memory_order_acquire) && M_queue(Message(msg)))
+        return;
+
+    M_send(msg);
+}
+
+void Logger::log(Message&& msg) noexcept
+{
+    if (M_queue(std::move(msg)))
+        return;
+
+    M_send(msg);
+}
+
+void Logger::log(CallSite const& site, DeferredArgs&& args) noexcept
+{
+    auto time = std::chrono::system_clock::now();
+
+    if (M_queue(site, std::move(args), time))
+        return;
+
+    Async::send(LogEntry(site, std::move(args), time));
+}
+
+void Logger::startAsync(std::size_t capacity, OverflowPolicy policy) noexcept
+{
+    std::lock_guard<std::mutex> control_lock(async_control_mutex);
+
+    {
+        std::lock_guard<std::mutex> lock(Logger::m_mutex);
+        M_maybeInstanciate();
+    }
+
+    if (m_async_enabled)
+        return;
+
+    try {
+        if (!m_async)
+            m_async = new Async();
+
+        // A power of two, to index the rings with a mask
+        std::size_t rounded = 1;
+        while (rounded < capacity)
+            rounded <<= 1;
+
+        m_async->capacity = rounded;
+        m_async->policy = policy;
+        m_async->stop = false;
+        m_async->thread = std::thread(&Async::run, m_async);
+
+        m_async_enabled = true;
+    } catch (std::exception const& exc) {
+        std::lock_guard<std::mutex> lock(Logger::m_mutex);
+
+        m_inst->m_fallback << "Failed to start asynchronous logging due to active exception ("
+                           << typeid(exc).name() << "): " << exc.what() << std::endl
+                           << "Logging synchronously." << std::endl << std::endl;
+        m_inst->m_fallback.flush();
+    }
+}
+
+void Logger::stopAsync() noexcept
+{
+    std::lock_guard<std::mutex> control_lock(async_control_mutex);
+
+    if (!m_async_enabled)
+        return;
+
+    m_async_enabled = false;
+
+    // Wait for the threads that saw asynchronous logging still enabled to
+    //   queue their message (the background thread keeps making room meanwhile)
+    for (;;)
+    {
+        bool busy = false;
+
+        {
+            std::lock_guard<std::mutex> lock(m_async->mutex);
+            for (LogRing* ring : m_async->rings)
+                busy = busy || ring->busy;
+        }
+
+        if (!busy)
+            break;
+        std::this_thread::yield();
+    }
+
+    m_async->stop = true;
+    m_async->thread.join();
+}
+
+void Logger::setQueueLimit(std::size_t max_bytes, Client::QueuePolicy policy, Message::Type level) noexcept
 {
     std::lock_guard<std::mutex> lock(Logger::m_mutex);
 
@@ -69,7 +477,44 @@ void Logger::log(Message const& msg) noexcept
     if (m_inst->m_remote)
     {
         try {
-            m_inst->m_remote->send(Message::serialize(msg));
+            m_inst->m_remote->setQueueLimit(max_bytes, policy, level);
+        } catch (std::exception const& exc) {
+            m_inst->m_fallback << "Failed to set the log queue limit due to active exception ("
+                               << typeid(exc).name() << ") : " << exc.what() << "." << std::endl << std::endl;
+            m_inst->m_fallback.flush();
+        }
+    }
+}
+
+bool Logger::M_queue(Message&& msg) noexcept
+{
+    // Pairs with startAsync(), which sets up m_async before enabling it
+    if (!m_async_enabled.load(std::memory_order_acquire))
+        return false;
+
+    Message::Type type = msg.type();
+    return m_async->queue(type, std::move(msg));
+}
+
+bool Logger::M_queue(CallSite const& site, DeferredArgs&& args,
+                     std::chrono::system_clock::time_point const& time) noexcept
+{
+    if (!m_async_enabled.load(std::memory_order_acquire))
+        return false;
+
+    return m_async->queue(site.type, site, std::move(args), time);
+}
+
+void Logger::M_send(Message const& msg) noexcept
+{
+    std::lock_guard<std::mutex> lock(Logger::m_mutex);
+
+    M_maybeInstanciate();
+
+    if (m_inst->m_remote)
+    {
+        try {
+            m_inst->m_remote->send(msg);
         } catch (std::exception const& exc) {
             m_inst->m_fallback << "Failed to send log message due to active exception ("
                                << typeid(exc).name() << ") : " << exc.what() << "." << std::endl
@@ -128,6 +573,12 @@ Logger::Logger(int argc, char** argv, unsigned short port, const char* fallback_
 
 Logger::~Logger()
 {
+    // Send the queued messages while we still can. The asynchronous state is
+    //   not deleted : a thread that saw asynchronous logging enabled may be
+    //   about to use it, and find it stopped.
+    if (m_async)
+        stopAsync();
+
     // Remove the fallback log file if we haven't written anything into it
     long l, m;
     std::ifstream fallback(m_fallback_fn, std::ios::in | std::ios::binary); 
@@ -17,12 +17,16 @@
  */
 
 #include "lesf/log/message.h"
+#include "lesf/log/call_site.h"
 #include "lconf/json.h"
 
 #include <boost/algorithm/hex.hpp>
 
 #include <memory>
 #include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
 
 namespace lconf { namespace json {
 
@@ -81,9 +85,105 @@ using namespace lconf;
 using namespace lesf;
 using namespace log;
 
+// Little endian binary encoding used by Message::serializeBinary() and co.
+class BinaryWriter
+{
+public:
+    BinaryWriter(std::string& out) :
+        m_out(out)
+    {}
+
+    template <typename T>
+    void integer(T value)
+    {
+        typename std::make_unsigned<T>::type bits = value;
+        for (std::size_t i = 0; i < sizeof(T); ++i)
+            m_out.push_back(static_cast<char>((bits >> (8 * i)) & 0xFF));
+    }
+
+    void string(std::string const& value)
+    {
+        integer<std::uint32_t>(value.size());
+        m_out.append(value);
+    }
+
+    template <typename BuildInfoT>
+    void buildInfo(BuildInfoT const& build_info)
+    {
+        string(build_info.file);
+        integer<std::int32_t>(build_info.line);
+        string(build_info.function);
+        string(build_info.build_date);
+        string(build_info.build_time);
+        string(build_info.user_build_id);
+        string(build_info.user_program);
+        string(build_info.user_version);
+    }
+
+private:
+    std::string& m_out;
+};
+
+class BinaryReader
+{
+public:
+    BinaryReader(std::string const& in) :
+        m_it(in.data()),
+        m_end(in.data() + in.size())
+    {}
+
+    template <typename T>
+    T integer()
+    {
+        M_need(sizeof(T));
+
+        typename std::make_unsigned<T>::type bits = 0;
+        for (std::size_t i = 0; i < sizeof(T); ++i)
+            bits |= static_cast<decltype(bits)>(static_cast<unsigned char>(*m_it++)) << (8 * i);
+
+        return static_cast<T>(bits);
+    }
+
+    std::string string()
+    {
+        std::uint32_t size = integer<std::uint32_t>();
+        M_need(size);
+
+        std::string value(m_it, size);
+        m_it += size;
+        return value;
+    }
+
+    template <typename BuildInfoT>
+    void buildInfo(BuildInfoT& build_info)
+    {
+        build_info.file = string();
+        build_info.line = integer<std::int32_t>();
+        build_info.function = string();
+        build_info.build_date = string();
+        build_info.build_time = string();
+        build_info.user_build_id = string();
+        build_info.user_program = string();
+        build_info.user_version = string();
+    }
+
+private:
+    void M_need(std::size_t size)
+    {
+        if (static_cast<std::size_t>(m_end - m_it) < size)
+            throw std::out_of_range("truncated binary log data");
+    }
+
+private:
+    const char* m_it;
+    const char* m_end;
+};
+
 Message::Message(Message::Type type, Message::BuildInfo&& build_info,
                  Message::ProcessInfo&& process_info, std::string const& message) :
     m_type(type),
+    m_call_site(0),
+    m_site(nullptr),
     m_build_info(std::move(build_info)),
     m_process_info(std::move(process_info)),
     m_time(std::chrono::system_clock::now()),
@@ -95,6 +195,39 @@ Message::Message(Message::Type type, Message::BuildInfo&& build_info,
                  Message::ProcessInfo&& process_info, std::string const& message,
                  core::Exception const& exception) :
     Message(type, std::move(build_info), std::move(process_info), message)
+{
+    M_setExceptionInfo(exception);
+}
+
+Message::Message(CallSite const& site, Message::ProcessInfo&& process_info,
+                 std::string const& message) :
+    m_type(site.type),
+    m_call_site(site.id()),
+    m_site(&site),
+    m_process_info(std::move(process_info)),
+    m_time(std::chrono::system_clock::now()),
+    m_message(message),
+    m_exception_info(nullptr)
+{}
+
+Message::Message(CallSite const& site, Message::ProcessInfo&& process_info,
+                 std::string const& message, core::Exception const& exception) :
+    Message(site, std::move(process_info), message)
+{
+    M_setExceptionInfo(exception);
+}
+
+Message::Message(CallSite const& site, Message::ProcessInfo&& process_info,
+                 std::string const& message, std::chrono::system_clock::time_point const& time) :
+    Message(site, std::move(process_info), message)
+{
+    m_time = time;
+}
+
+Message::~Message()
+{}
+
+void Message::M_setExceptionInfo(core::Exception const& exception)
 {
     m_exception_info = std::make_shared<ExceptionInfo>();
 
@@ -122,17 +255,19 @@ Message::Message(Message::Type type, Message::BuildInfo&& build_info,
     }
 }
 
-Message::~Message()
-{}
-
 Message::Type Message::type() const
 {
     return m_type;
 }
 
-Message::BuildInfo const& Message::buildInfo() const
+unsigned Message::callSite() const
+{
+    return m_call_site;
+}
+
+Message::BuildInfo Message::buildInfo() const
 {
-    return m_build_info;
+    return m_site ? m_site->buildInfo() : m_build_info;
 }
 
 Message::ProcessInfo const& Message::processInfo() const
@@ -156,12 +291,35 @@ Message::ExceptionInfoPtr Message::exceptionInfo() const
 }
 
 std::string Message::serialize(Message const& msg) noexcept
+{
+    return M_serialize(msg, true);
+}
+
+std::string Message::serializeCompact(Message const& msg) noexcept
+{
+    return M_serialize(msg, !msg.m_call_site);
+}
+
+std::string Message::M_serialize(Message const& msg, bool with_build_info) noexcept
 {
     try {
         // Construct the JSON template for the message
         //   (aarg, this const_cast is ugly, I should update lconf::json::Template
         //   to accept const references)
         json::Template tpl = const_cast<Message&>(msg).M_jsonTemplate();
+
+        // Include the build info, unless it was sent along with the call site
+        json::Template tpl_build_info_wrapper;
+        tpl_build_info_wrapper.bind("set", with_build_info);
+
+        BuildInfo build_info;
+        if (with_build_info)
+        {
+            build_info = msg.buildInfo();
+            tpl_build_info_wrapper.bind("data", M_buildInfoJsonTemplate(build_info));
+        }
+
+        tpl.bind("build_info", tpl_build_info_wrapper);
         
         // Try to include the exception info, if any
         bool has_exception_info = (bool) msg.m_exception_info;
@@ -192,12 +350,21 @@ std::string Message::serialize(Message const& msg) noexcept
 }
 
 Message Message::synthetize(std::string const& serialized) noexcept
+{
+    return synthetize(serialized, CallSites());
+}
+
+Message Message::synthetize(std::string const& serialized, CallSites const& call_sites) noexcept
 {
     try {
         Message msg(Message::Unknown, {}, {}, "");
 
-        // Create the basic JSON template (without exception info)
+        // Create the basic JSON template (without build and exception info)
         json::Template tpl = msg.M_jsonTemplate();
+        json::Template tpl_build_info_wrapper;
+        bool has_build_info;
+        tpl_build_info_wrapper.bind("set", has_build_info);
+        tpl.bind("build_info", tpl_build_info_wrapper);
         json::Template tpl_exception_info_wrapper;
         bool has_exception_info;
         tpl_exception_info_wrapper.bind("set", has_exception_info);
@@ -208,6 +375,24 @@ Message Message::synthetize(std::string const& serialized) noexcept
         json::ObjectNode* repr = json::parse(ss)->downcast<json::ObjectNode>();
         tpl.extract(repr);
 
+        // Get the build info from the message itself, or from its call site
+        if (has_build_info)
+        {
+            json::Template tpl_build_info = M_buildInfoJsonTemplate(msg.m_build_info);
+
+            json::Node* repr_build_info =
+                repr->get("build_info")->downcast<json::ObjectNode>()
+                    ->get("data");
+
+            tpl_build_info.extract(repr_build_info);
+        }
+        else
+        {
+            auto it = call_sites.find(msg.m_call_site);
+            if (it != call_sites.end())
+                msg.m_build_info = it->second;
+        }
+
         // Check if exception info was present
         if (has_exception_info)
         {
@@ -231,11 +416,163 @@ Message Message::synthetize(std::string const& serialized) noexcept
     }
 }
 
+std::string Message::serializeCallSite(CallSite const& site) noexcept
+{
+    try {
+        int id = site.id();
+        BuildInfo build_info = site.buildInfo();
+
+        json::Template tpl;
+        tpl.bind("id", id);
+        tpl.bind("build_info", M_buildInfoJsonTemplate(build_info));
+
+        json::Node* repr = tpl.synthetize();
+
+        std::ostringstream ss;
+        repr->serialize(ss, false);
+        delete repr;
+        return ss.str();
+    } catch (std::exception const&) {
+        // An unknown call site, its messages will lack build info
+        return "{}";
+    }
+}
+
+bool Message::synthetizeCallSite(std::string const& serialized, CallSites& call_sites) noexcept
+{
+    try {
+        int id;
+        BuildInfo build_info;
+
+        json::Template tpl;
+        tpl.bind("id", id);
+        tpl.bind("build_info", M_buildInfoJsonTemplate(build_info));
+
+        std::istringstream ss(serialized);
+        json::Node* repr = json::parse(ss);
+        tpl.extract(repr);
+        delete repr;
+
+        call_sites[id] = std::move(build_info);
+        return true;
+    } catch (std::exception const&) {
+        return false;
+    }
+}
+
+std::string Message::serializeBinary(Message const& msg) noexcept
+{
+    try {
+        std::string serialized;
+        BinaryWriter out(serialized);
+
+        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(msg.m_time.time_since_epoch());
+
+        out.integer<std::int8_t>(msg.m_type);
+        out.integer<std::uint32_t>(msg.m_call_site);
+        out.integer<std::int64_t>(time.count());
+        out.string(msg.m_process_info.process);
+        out.integer<std::int32_t>(msg.m_process_info.pid);
+        out.string(msg.m_message);
+
+        // Build info only if it wasn't sent along with the call site
+        out.integer<std::uint8_t>(!msg.m_call_site);
+        if (!msg.m_call_site)
+            out.buildInfo(msg.buildInfo());
+
+        out.integer<std::uint8_t>((bool) msg.m_exception_info);
+        if (msg.m_exception_info)
+        {
+            out.string(msg.m_exception_info->what);
+            out.string(msg.m_exception_info->rtti_type);
+            out.buildInfo(msg.m_exception_info->build_info);
+            out.string(msg.m_exception_info->trace);
+        }
+
+        return serialized;
+    } catch (std::exception const&) {
+        // Can't even allocate, the session will report a truncated message
+        return std::string();
+    }
+}
+
+Message Message::synthetizeBinary(std::string const& serialized, CallSites const& call_sites) noexcept
+{
+    try {
+        Message msg(Message::Unknown, {}, {}, "");
+        BinaryReader in(serialized);
+
+        msg.m_type = static_cast<Type>(in.integer<std::int8_t>());
+        msg.m_call_site = in.integer<std::uint32_t>();
+        msg.m_time = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(in.integer<std::int64_t>())));
+        msg.m_process_info.process = in.string();
+        msg.m_process_info.pid = in.integer<std::int32_t>();
+        msg.m_message = in.string();
+
+        if (in.integer<std::uint8_t>())
+            in.buildInfo(msg.m_build_info);
+        else
+        {
+            auto it = call_sites.find(msg.m_call_site);
+            if (it != call_sites.end())
+                msg.m_build_info = it->second;
+        }
+
+        if (in.integer<std::uint8_t>())
+        {
+            msg.m_exception_info = std::make_shared<ExceptionInfo>();
+            msg.m_exception_info->what = in.string();
+            msg.m_exception_info->rtti_type = in.string();
+            in.buildInfo(msg.m_exception_info->build_info);
+            msg.m_exception_info->trace = in.string();
+        }
+
+        return msg;
+    } catch (std::exception const& exc) {
+        std::ostringstream ss;
+        ss << "<binary log message synthesis failed: " << exc.what() << ">";
+        return Message(Message::Unknown, {}, {}, ss.str());
+    }
+}
+
+std::string Message::serializeCallSiteBinary(CallSite const& site) noexcept
+{
+    try {
+        std::string serialized;
+        BinaryWriter out(serialized);
+
+        out.integer<std::uint32_t>(site.id());
+        out.buildInfo(site.buildInfo());
+
+        return serialized;
+    } catch (std::exception const&) {
+        return std::string();
+    }
+}
+
+bool Message::synthetizeCallSiteBinary(std::string const& serialized, CallSites& call_sites) noexcept
+{
+    try {
+        BinaryReader in(serialized);
+
+        unsigned id = in.integer<std::uint32_t>();
+        BuildInfo build_info;
+        in.buildInfo(build_info);
+
+        call_sites[id] = std::move(build_info);
+        return true;
+    } catch (std::exception const&) {
+        return false;
+    }
+}
+
 json::Template Message::M_jsonTemplate()
 {
     json::Template tpl;
     tpl.bind("type", (int&) m_type);
-    tpl.bind("build_info", M_buildInfoJsonTemplate());
+    tpl.bind("call_site", (int&) m_call_site);
     tpl.bind("process_info", M_processInfoJsonTemplate());
     tpl.bind("time", m_time);
     tpl.bind("message", m_message);
@@ -243,17 +580,17 @@ json::Template Message::M_jsonTemplate()
     return tpl;
 }
 
-json::Template Message::M_buildInfoJsonTemplate()
+json::Template Message::M_buildInfoJsonTemplate(BuildInfo& build_info)
 {
     json::Template tpl;
-    tpl.bind("file", m_build_info.file);
-    tpl.bind("line", m_build_info.line);
-    tpl.bind("function", m_build_info.function);
-    tpl.bind("build_date", m_build_info.build_date);
-    tpl.bind("build_time", m_build_info.build_time);
-    tpl.bind("user_build_id", m_build_info.user_build_id);
-    tpl.bind("user_program", m_build_info.user_program);
-    tpl.bind("user_version", m_build_info.user_version);
+    tpl.bind("file", build_info.file);
+    tpl.bind("line", build_info.line);
+    tpl.bind("function", build_info.function);
+    tpl.bind("build_date", build_info.build_date);
+    tpl.bind("build_time", build_info.build_time);
+    tpl.bind("user_build_id", build_info.user_build_id);
+    tpl.bind("user_program", build_info.user_program);
+    tpl.bind("user_version", build_info.user_version);
     return tpl;
 }
 
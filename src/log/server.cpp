@@ -105,10 +105,8 @@ void Server::M_doAccept()
         });
 }
 
-void Server::M_notifyMessageReceived(std::string const& data)
+void Server::M_notifyMessageReceived(Message const& msg)
 {
-    Message msg = Message::synthetize(data);
-
     for (auto it : m_subscribers)
         it->M_notifyMessageReceived(msg);
 }
@@ -46,7 +46,10 @@ Session::Internals::Internals(tcp::socket&& socket, std::set<std::shared_ptr<Ses
 {}
 
 Session::Session(Session::Internals&& internals) :
-    m_internals(new Session::Internals(std::move(internals)))
+    m_internals(new Session::Internals(std::move(internals))),
+    m_binary(false),
+    m_answer(0),
+    m_kind(MessageFrame)
 {
 }
 
@@ -76,18 +79,58 @@ void Session::start()
 void Session::M_doReadHeader()
 {
     auto self(shared_from_this());
-    async_read(m_internals->socket, buffer(m_header),
+    async_read(m_internals->socket, buffer(m_header.data(), m_binary ? BinaryHeaderSize : HeaderSize),
         [this, self](error_code const& err, std::size_t)
         {
             if (!err)
             {
-                std::size_t size = std::atoi(std::string(m_header.begin(), m_header.end()).c_str());
+                std::size_t size = 0;
+
+                if (m_binary)
+                {
+                    for (std::size_t i = 0; i < 4; ++i)
+                        size |= static_cast<std::size_t>(static_cast<unsigned char>(m_header[i])) << (8 * i);
+                    m_kind = static_cast<FrameKind>(m_header[4]);
+
+                    // The protocol can't change anymore
+                    if (m_kind != MessageFrame && m_kind != CallSiteFrame)
+                    {
+                        M_close();
+                        return;
+                    }
+                }
+                else
+                {
+                    char kind = m_header[0];
+                    m_kind = (kind == CallSiteFrame || kind == HelloFrame || kind == BinaryFrame) ?
+                        static_cast<FrameKind>(kind) : MessageFrame;
+
+                    auto digits = m_header.begin() + (m_kind == MessageFrame ? 0 : 1);
+                    for (auto it = digits; it != m_header.end(); ++it)
+                    {
+                        if (*it < '0' || *it > '9')
+                        {
+                            M_close();
+                            return;
+                        }
+
+                        size = size * 10 + (*it - '0');
+                    }
+                }
+
+                // Don't let a corrupted stream allocate whatever it says
+                if (size > MaxFrameSize)
+                {
+                    M_close();
+                    return;
+                }
+
                 m_message.resize(size);
                 M_doReadMessage();
             }
             else
             {
-                m_internals->sessions.erase(shared_from_this());
+                M_close();
             }
         });
 }
@@ -100,12 +143,58 @@ void Session::M_doReadMessage()
         {
             if (!err)
             {
-                m_internals->server->M_notifyMessageReceived(std::string(m_message.begin(), m_message.end()));
+                std::string data(m_message.begin(), m_message.end());
+
+                switch (m_kind)
+                {
+                case HelloFrame:
+                    m_answer = std::atoi(data.c_str()) == ProtocolVersion ? ProtocolVersion : 0;
+                    M_doAnswerHello();
+                    break;
+
+                case BinaryFrame:
+                    m_binary = true;
+                    break;
+
+                case CallSiteFrame:
+                    if (!(m_binary ?
+                          Message::synthetizeCallSiteBinary(data, m_call_sites) :
+                          Message::synthetizeCallSite(data, m_call_sites)))
+                    {
+                        M_close();
+                        return;
+                    }
+                    break;
+
+                default:
+                    m_internals->server->M_notifyMessageReceived(m_binary ?
+                        Message::synthetizeBinary(data, m_call_sites) :
+                        Message::synthetize(data, m_call_sites));
+                    break;
+                }
+
                 M_doReadHeader();
             }
             else
             {
-                m_internals->sessions.erase(shared_from_this());
+                M_close();
             }
         });
 }
+
+void Session::M_close()
+{
+    error_code err;
+    m_internals->socket.close(err);
+    m_internals->sessions.erase(shared_from_this());
+}
+
+void Session::M_doAnswerHello()
+{
+    auto self(shared_from_this());
+    async_write(m_internals->socket, buffer(&m_answer, 1),
+        [this, self](error_code const&, std::size_t)
+        {
+            // Errors are noticed by the reading side
+        });
+}